@@ -1,19 +1,54 @@
 #include <assert.h>
 
-#include <fstream>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #define OMPI_SKIP_MPICXX 1
+#include <fcntl.h>
 #include <mpi.h>
+#include <omp.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <random>
+#include <thread>
+#include <unordered_map>
 
 constexpr uint32_t num_lines = 3;
 
-using adjacency_matrix = std::vector<std::vector<uint32_t>>;
+// Non-owning view of an array, lets the topology of a network live either
+// in its own vectors or directly in a mapped file
+template <typename T>
+struct ArrayView {
+    T *ptr;
+    size_t len;
+
+    ArrayView()
+        : ptr(nullptr), len(0) {}
+    ArrayView(T *ptr, size_t len)
+        : ptr(ptr), len(len) {}
+
+    T &operator[](size_t i) const { return ptr[i]; }
+
+    T *data() const { return ptr; }
+    size_t size() const { return len; }
+
+    T *begin() const { return ptr; }
+    T *end() const { return ptr + len; }
+};
 
 struct Station {
     uint32_t popularity;
@@ -147,9 +182,72 @@ void Troon::register_type() {
     MPI_Type_commit(&datatype);
 }
 
+struct InputFile;
+struct InputReader;
+
+struct Options {
+    // How troons are passed between ranks every tick, see TickExchange
+    enum class Exchange {
+        p2p,
+        neighbor,
+        rma,
+    };
+
+    const char *input_path;
+
+    // Partition the link graph instead of splitting by load alone
+    bool graph_partition;
+
+    // Simulated ticks between rebalancing the links between ranks, 0 to
+    // never rebalance. Ticks skipped by the event driven mode do not count
+    uint32_t rebalance_interval;
+
+    // Let the ranks run ahead of each other, see LookaheadExchange
+    bool lookahead;
+
+    Exchange exchange;
+
+    // Threads updating the links of a rank in the tick by tick simulation
+    int num_threads;
+
+    // Run a single process on the threads of SharedEngine instead
+    bool shared_engine;
+
+    // Skip the ticks in which nothing happens, see next_tick
+    bool event_driven;
+
+    // Skip whole periods once the troons repeat, see CycleDetector
+    bool fast_forward;
+
+    Options();
+};
+
+// Memory shared by the ranks of a node, allocated by the node leader
+// (node rank 0) and mapped by the others
+struct SharedWindow {
+    MPI_Win win;
+    char *data;
+
+    // Whether this rank owns the memory and fills in the topology, true
+    // when it is not shared. The other ranks of the node only write their
+    // own disjoint link lengths into it before a sync
+    bool writable;
+
+    SharedWindow();
+    SharedWindow(size_t size, MPI_Comm node_comm);
+
+    SharedWindow(SharedWindow &&other);
+    SharedWindow(const SharedWindow &) = delete;
+    SharedWindow &operator=(SharedWindow &&other);
+    ~SharedWindow();
+
+    // Makes the writes of every rank visible to the others, collective
+    void sync() const;
+};
+
 struct Network {
-    std::vector<Station> stations;
-    std::vector<Link> links;
+    ArrayView<Station> stations;
+    ArrayView<Link> links;
 
     uint32_t line_forward_start[num_lines];
     uint32_t line_backward_start[num_lines];
@@ -160,23 +258,42 @@ struct Network {
 
     uint32_t num_line_troons_spawned[num_lines];
 
-    std::vector<std::string> station_names;
+    // Only kept on the root
+    std::vector<std::string_view> station_names;
 
     Network();
 
     Network(uint32_t num_stations,
-            std::vector<uint32_t> &popularities, adjacency_matrix &mat,
-            std::vector<std::string> &station_names,
-            std::vector<std::string> &green_station_names,
-            std::vector<std::string> &yellow_station_names,
-            std::vector<std::string> &blue_station_names,
+            std::vector<uint32_t> &popularities,
+            std::vector<std::string_view> &names,
+            std::vector<uint32_t> &green_stations,
+            std::vector<uint32_t> &yellow_stations,
+            std::vector<uint32_t> &blue_stations,
             uint32_t ticks, uint32_t num_green, uint32_t num_yellow,
             uint32_t num_blue, uint32_t num_print_lines);
 
+    // Maps a network compiled with write_binary, without copying it
+    Network(std::unique_ptr<InputFile> file);
+
+    Network(Network &&);
+    Network(const Network &) = delete;
+    Network &operator=(Network &&);
+    ~Network();
+
+    void read_link_lengths(InputReader &reader, uint64_t first_entry,
+                           uint64_t num_entries);
+    void write_binary(const char *path) const;
+    void read_binary(MPI_File file, MPI_Comm node_comm, MPI_Comm leader_comm,
+                     int rank);
+
     void print() const;
 
-    void broadcast();
-    void receive();
+    void broadcast(MPI_Comm node_comm, MPI_Comm leader_comm);
+    void receive(MPI_Comm node_comm, MPI_Comm leader_comm);
+
+    void sync_shared() const;
+
+    void renumber(const std::vector<uint32_t> &order);
 
     size_t troon_count() const;
 
@@ -184,74 +301,411 @@ struct Network {
     const Station *dst(uint32_t link_id) const;
 
    private:
+    // Backing storage of the views when the network is not mapped
+    std::vector<Station> station_storage;
+    std::vector<Link> link_storage;
+    std::vector<char> name_storage;
+
+    // Mapped input the views point into, if any
+    std::unique_ptr<InputFile> source;
+
+    // Topology shared by all ranks of the node, once distributed
+    SharedWindow shared_storage;
+
     uint32_t add_link(size_t src, size_t dst,
-                      const adjacency_matrix &length_mat, adjacency_matrix &link_mat);
+                      std::unordered_map<uint64_t, uint32_t> &link_ids);
+
+    void use_storage();
+    void use_shared_storage(uint32_t num_stations, uint32_t num_links,
+                            MPI_Comm node_comm);
+    void set_station_names(const std::vector<std::string_view> &names);
 };
 
-struct LinkState {
-    struct CompareTroon {
-        const std::vector<Troon> *troons;
-        bool operator()(uint32_t index_a, uint32_t index_b) {
-            const Troon *a = troons->data() + index_a - 1;
-            const Troon *b = troons->data() + index_b - 1;
-            if (a->state_timestamp != b->state_timestamp) {
-                return a->state_timestamp > b->state_timestamp;
-            }
+// Layout of a compiled network file, followed by the stations, the links,
+// num_stations + 1 offsets into the station names and the names themselves
+struct NetworkFileHeader {
+    static constexpr char file_magic[8] = {'T', 'R', 'O', 'O', 'N', 'B', 'I', 'N'};
+    static constexpr uint32_t file_version = 1;
 
-            return a->id > b->id;
-        }
+    char magic[8];
+    uint32_t version;
+    uint32_t num_stations;
+    uint32_t num_links;
+
+    uint32_t line_forward_start[num_lines];
+    uint32_t line_backward_start[num_lines];
+
+    uint32_t ticks;
+    uint32_t num_line_troons_total[num_lines];
+    uint32_t num_print_lines;
+
+    uint32_t names_size;
+
+    static bool matches(const InputFile &file);
+};
+
+// Assignment of contiguous ranges of link ids to ranks
+struct Partition {
+    // Rank r owns the links in [bounds[r], bounds[r + 1])
+    std::vector<uint32_t> bounds;
+
+    // owner[link_id] is the rank that owns the link
+    std::vector<int> owner;
+
+    // Old link ids in their new order, when the links have to be
+    // renumbered to make the ranges of the ranks contiguous
+    std::vector<uint32_t> order;
+
+    Partition(int num_proc);
+
+    // Balances the expected load of the ranks, see link_load
+    Partition(const Network &network, int num_proc);
+
+    // Partitions the link graph to minimize the links connected across
+    // ranks, subject to balancing the load
+    static Partition minimize_cut(const Network &network, int num_proc);
+
+    void broadcast(bool renumbered, size_t num_links);
 
-        CompareTroon(const std::vector<Troon> *troons)
-            : troons(troons) {}
+    int link_rank(uint32_t link_id) const;
+
+    // Number of (link, next link) connections between different ranks
+    size_t cut_size(const Network &network) const;
+
+    // Moves the bounds to balance the measured cost of the links, returns
+    // whether any link changed owner
+    bool rebalance(const std::vector<double> &link_cost);
+
+   private:
+    void balance(const std::vector<double> &load);
+    void update_owners();
+};
+
+// Troons in a waiting area by arrival tick and then id. Troons arrive in
+// tick order, and LinkGroup::reset pushes them sorted, so a push only moves
+// past the few troons that arrived in the same tick. Entries keep the order keys next to the troon index to not
+// look up the troons
+struct WaitingQueue {
+    struct Entry {
+        uint32_t timestamp;
+        uint32_t id;
+        uint32_t index;
+
+        bool operator<(const Entry &other) const;
     };
 
-    std::priority_queue<uint32_t, std::vector<uint32_t>, CompareTroon>
-        waiting_platform;
-    uint32_t on_platform;
-    uint32_t in_transit;
+    // Ring buffer, the capacity is zero or a power of two
+    std::vector<Entry> entries;
+    uint32_t head;
+    uint32_t count;
+
+    WaitingQueue();
+
+    void push(uint32_t index, const Troon &troon);
+    uint32_t top() const;
+    void pop();
+    bool empty() const;
 
-    LinkState(const std::vector<Troon> *troons);
+    // Moves the arrival ticks of all troons by ticks
+    void shift(uint32_t ticks);
+
+   private:
+    Entry &at(uint32_t position);
+    void grow();
+};
+
+// State of the links of a rank as arrays by local link, so the loops over
+// the links read contiguous memory. The platform and transit arrays repeat
+// the state of the troons there, the troons stay the record that is printed
+// and sent to other ranks
+struct LinkStates {
+    // Copied from the links
+    std::vector<uint32_t> length;
+    std::vector<uint32_t> popularity;
+
+    std::vector<WaitingQueue> waiting_platform;
+    std::vector<uint32_t> on_platform;
+    std::vector<uint32_t> in_transit;
+
+    // State of the troon on the platform and since when
+    std::vector<Troon::State> platform_state;
+    std::vector<uint32_t> platform_timestamp;
+
+    // Tick the troon in transit reaches the end of the link, never when the
+    // link is empty
+    std::vector<uint32_t> transit_end;
+
+    static constexpr uint32_t never = std::numeric_limits<uint32_t>::max();
+
+    void reset(const Network &network, uint32_t start, uint32_t end);
 };
 
 struct LinkGroup {
     std::vector<Troon> troons;
-    std::vector<LinkState> link_states;
+    LinkStates link_states;
+
+    // Slots of the troons that left the rank, the next troons that come in
+    // take them so troons only grows with the troons on the rank
+    std::vector<uint32_t> free_slots;
+
     uint32_t start;
     uint32_t end;
 
-    LinkGroup(int rank, int num_proc, size_t num_links);
+    // Time spent simulating the links since the last rebalance, without
+    // waiting for other ranks
+    double compute_time;
+
+    LinkGroup(const Network &network, const Partition &partition, int rank);
+
+    // Takes over the range of the rank in the partition, with the valid
+    // troons placed on their links by state
+    void reset(const Network &network, const Partition &partition, int rank,
+               std::vector<Troon> &&link_troons);
 
     bool has_link(uint32_t link_id) const;
     uint32_t count() const;
 
-    LinkState *get_link_state(uint32_t link_id);
+    // Index of a link of the rank in the link states
+    uint32_t link_index(uint32_t link_id) const;
     Troon *get_troon(uint32_t index);
 
+    // Stores a troon coming to the rank and puts it in the waiting area of
+    // its link
+    uint32_t add_troon(const Troon &troon);
+
+    // Marks the troon as invalid and frees its slot
+    void remove_troon(uint32_t index);
+
+    // Copies of the valid troons
+    std::vector<Troon> live_troons() const;
+
+    // The steps of the engines. Each changes a troon and the state of its
+    // link together
+
+    // Puts the troon at index in the waiting area of its link
+    void enqueue(uint32_t index);
+
+    // Whether the troon in transit on the link reaches its end at tick
+    bool transit_done(uint32_t link_id, uint32_t tick) const;
+
+    // Takes the troon at the end of the link off it, bound for the waiting
+    // area of dst_link_id. Returns its index
+    uint32_t finish_transit(uint32_t link_id, uint32_t dst_link_id,
+                            uint32_t tick);
+
+    // Moves the troons of the link between the waiting area, the platform
+    // and the link itself at the end of the tick
+    void update_platform(uint32_t link_id, uint32_t tick);
+
+    // Moves the troons and the links ahead by ticks
+    void shift(uint32_t ticks);
+
     friend std::ostream &operator<<(std::ostream &os, const LinkGroup &group) {
         os << '[' << group.start << ", " << group.end << "]\n";
         return os;
     }
 };
 
-struct TroonMessage {
-    Troon troon;
-    uint32_t src_link;
-    uint32_t dst_link;
+// Troons crossing to other ranks in the tick by tick simulation. Every
+// tick each neighbouring rank gets one message with the troons arriving
+// on its links. The p2p exchange compiles these messages into persistent
+// requests over fixed buffers once, the neighbor exchange does them with
+// neighbourhood collectives over a graph of the neighbours. The rma
+// exchange puts the troons and their count straight into an inbox window
+// of the receiving rank, with one block per sending rank.
+//
+// A link sends at most one troon per tick, so a rank never gets more
+// troons from a rank than that rank has links leading to its links. The
+// buffers hold that many troons per rank, unused slots are empty troons
+struct TickExchange {
+    static constexpr int troon_tag = 3;
+    static constexpr int inbox_tag = 4;
+
+    Options::Exchange mode;
+    MPI_Comm neighbor_comm;
+
+    // The block of a sending rank in the inbox is a troon count followed
+    // by its troon slots. inbox_offsets are the byte offsets of our blocks
+    // per receive rank, target_offsets those of our block in the inbox of
+    // each send rank
+    MPI_Win inbox_win;
+    char *inbox;
+    std::vector<MPI_Aint> inbox_offsets;
+    std::vector<MPI_Aint> target_offsets;
+    MPI_Group send_group;
+    MPI_Group receive_group;
+
+    // Ranks owning a next link of one of our links, and the troons
+    // arriving there this tick
+    std::vector<int> send_ranks;
+    std::vector<int> send_index;
+    std::vector<int> send_capacity;
+    std::vector<int> send_offsets;
+    std::vector<int> send_counts;
+    std::vector<Troon> send_buffer;
+
+    // Ranks owning a previous link of one of our links
+    std::vector<int> receive_ranks;
+    std::vector<int> receive_capacity;
+    std::vector<int> receive_offsets;
+    std::vector<Troon> receive_buffer;
+    std::vector<int> receive_counts;
+
+    // Troon counts sent ahead of the troons by the p2p and rma exchanges.
+    // A p2p message is the count followed by all the troon slots of the
+    // rank, described at the addresses of the count and the slots
+    std::vector<uint32_t> send_headers;
+    std::vector<uint32_t> receive_headers;
+    std::vector<MPI_Datatype> message_types;
+
+    std::vector<MPI_Request> requests;
+
+    // Our links with no previous link on another rank, these can be
+    // updated before the exchange is finished, and the other links
+    std::vector<uint32_t> interior_links;
+    std::vector<uint32_t> boundary_links;
+
+    // Indices of the boundary links fed by each receive rank, and the
+    // number of receive ranks each boundary link still waits for
+    std::vector<std::vector<uint32_t>> receive_links;
+    std::vector<uint32_t> num_inputs;
+    std::vector<uint32_t> missing_inputs;
+    size_t num_received;
+    bool receiving;
+
+    // Collective when using the neighbor or the rma exchange
+    TickExchange(const Network &network, const Partition &partition,
+                 const LinkGroup &link_group, int rank,
+                 Options::Exchange mode);
+
+    TickExchange(const TickExchange &) = delete;
+    TickExchange(TickExchange &&other);
+    TickExchange &operator=(TickExchange &&other);
+    ~TickExchange();
+
+    void swap(TickExchange &other);
+
+    void add(const Troon &troon, const Partition &partition);
+
+    // Starts sending the added troons
+    void start();
+
+    // Receives the troons of at least one more rank, and the boundary
+    // links that now have all their arrivals. Returns false once
+    // everything is received
+    bool receive_some(std::vector<Troon> &arrivals,
+                      std::vector<uint32_t> &ready_links);
+
+   private:
+    void finish_sends();
+    void finish_neighbor(std::vector<Troon> &arrivals);
+    void finish_rma(std::vector<Troon> &arrivals);
+
+    void create_inbox();
+    static MPI_Datatype message_type(uint32_t *count, Troon *troons,
+                                     int capacity);
+};
+
+// Private memory mapping of a whole input file, writes are never carried
+// through to the file
+struct InputFile {
+    char *data;
+    size_t size;
+
+    InputFile(const char *path);
+    ~InputFile();
+
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+
+    bool is_open() const;
+};
+
+// Parses integers and words in place from a character buffer, a drop-in
+// for the std::ifstream >> path: numbers and words are whitespace
+// separated tokens wherever they are on the lines. Only the line
+// definitions are read as whole lines
+struct InputReader {
+    const char *pos;
+    const char *end;
 
-    TroonMessage(const Troon &troon, uint32_t src_link, uint32_t dst_link);
-    TroonMessage(uint32_t src_link, uint32_t dst_link);
+    InputReader(const char *begin, const char *end);
+
+    uint32_t read_uint();
+    std::string_view read_word();
+    std::string_view read_line();
+
+    void skip_space();
+    void skip_uint();
+    void skip_line();
+};
+
+// The tokens of the text input that start inside the byte range of a rank,
+// read collectively with MPI-IO. Tokens are the whitespace separated
+// numbers and words, so the ranks agree on the index of every matrix entry
+// however its rows are split into lines
+struct InputChunk {
+    std::vector<char> data;
+
+    // Offset in the input of data, which starts one byte before the range
+    MPI_Offset offset;
+
+    // The byte range of the rank
+    MPI_Offset begin;
+    MPI_Offset end;
+
+    // Index in the whole input of the first token that starts in the range,
+    // and the number of tokens that do
+    uint64_t first_token;
+    uint64_t num_tokens;
+
+    InputChunk(MPI_File file, int rank, int num_proc);
+
+    bool has_token(uint64_t token) const;
+
+    // Reader at the start of a token of the chunk, until the end of the
+    // chunk
+    InputReader reader_at(uint64_t token) const;
+
+    // Offset in the input right after a token of the chunk
+    MPI_Offset token_end(uint64_t token) const;
+
+    // The bytes of the range of the rank that are in [from, to)
+    std::string_view bytes(MPI_Offset from, MPI_Offset to) const;
+
+   private:
+    const char *find_token(uint64_t token) const;
 };
 
-std::vector<std::string> extract_station_names(std::string &line) {
-    constexpr char space_delimiter = ' ';
-    std::vector<std::string> stations;
+// Splits a line of station names and resolves each of them to its id,
+// a single pass over the line
+std::vector<uint32_t> resolve_station_names(
+    std::string_view line,
+    const std::unordered_map<std::string_view, uint32_t> &station_ids) {
+    std::vector<uint32_t> stations;
+
+    size_t pos = 0;
+    while (pos < line.size()) {
+        if (line[pos] == ' ') {
+            pos++;
+            continue;
+        }
+
+        size_t name_end = line.find(' ', pos);
+        if (name_end == std::string_view::npos) {
+            name_end = line.size();
+        }
+
+        std::string_view name = line.substr(pos, name_end - pos);
 
-    line += ' ';
+        auto it = station_ids.find(name);
+        if (it == station_ids.end()) {
+            std::cerr << "Unknown station " << name << '\n';
+            std::exit(2);
+        }
 
-    size_t pos;
-    while ((pos = line.find(space_delimiter)) != std::string::npos) {
-        stations.push_back(line.substr(0, pos));
-        line.erase(0, pos + 1);
+        stations.push_back(it->second);
+        pos = name_end;
     }
 
     return stations;
@@ -267,17 +721,6 @@ bool arr_contains(uint32_t val, const uint32_t *arr, uint32_t size) {
     return false;
 }
 
-// Assumes that the array contains the value
-size_t find_index(std::string &val, std::vector<std::string> &arr) {
-    for (size_t i = 0; i < arr.size(); i++) {
-        if (val == arr[i]) {
-            return i;
-        }
-    }
-
-    assert(false);
-}
-
 Station::Station()
     : popularity(0) {}
 
@@ -303,23 +746,132 @@ Troon::Troon()
 Troon::Troon(uint32_t id, uint32_t line, uint32_t tick, uint32_t link)
     : id(id), line(line), state(State::waiting_platform), state_timestamp(tick), on_link(link) {}
 
-LinkState::LinkState(const std::vector<Troon> *troons)
-    : waiting_platform(CompareTroon(troons)), on_platform(0), in_transit(0) {}
+bool WaitingQueue::Entry::operator<(const Entry &other) const {
+    if (timestamp != other.timestamp) {
+        return timestamp < other.timestamp;
+    }
+
+    return id < other.id;
+}
 
-LinkGroup::LinkGroup(int rank, int num_proc, size_t num_links) {
-    size_t quot = num_links / num_proc;
+WaitingQueue::WaitingQueue() : head(0), count(0) {}
 
-    start = rank * quot + 1;
-    if (rank == num_proc - 1) {
-        end = num_links + 1;
-    } else {
-        end = start + quot;
+WaitingQueue::Entry &WaitingQueue::at(uint32_t position) {
+    return entries[(head + position) & (entries.size() - 1)];
+}
+
+void WaitingQueue::grow() {
+    std::vector<Entry> grown(std::max<size_t>(4, entries.size() * 2));
+    for (uint32_t i = 0; i < count; i++) {
+        grown[i] = at(i);
     }
 
+    entries.swap(grown);
+    head = 0;
+}
+
+void WaitingQueue::push(uint32_t index, const Troon &troon) {
+    if (count == entries.size()) {
+        grow();
+    }
+
+    Entry entry = {troon.state_timestamp, troon.id, index};
+    uint32_t position = count++;
+    while (position > 0 && entry < at(position - 1)) {
+        at(position) = at(position - 1);
+        position--;
+    }
+    at(position) = entry;
+}
+
+uint32_t WaitingQueue::top() const {
+    assert(count > 0);
+    return entries[head].index;
+}
+
+void WaitingQueue::pop() {
+    assert(count > 0);
+    head = (head + 1) & (entries.size() - 1);
+    count--;
+}
+
+bool WaitingQueue::empty() const {
+    return count == 0;
+}
+
+void WaitingQueue::shift(uint32_t ticks) {
+    for (uint32_t i = 0; i < count; i++) {
+        at(i).timestamp += ticks;
+    }
+}
+
+void LinkStates::reset(const Network &network, uint32_t start,
+                       uint32_t end) {
     size_t count = end - start;
-    link_states.reserve(count);
-    for (size_t i = 0; i < count; i++) {
-        link_states.emplace_back(&troons);
+
+    length.resize(count);
+    popularity.resize(count);
+    for (uint32_t link_id = start; link_id < end; link_id++) {
+        length[link_id - start] = network.links[link_id - 1].length;
+        popularity[link_id - start] = network.src(link_id)->popularity;
+    }
+
+    waiting_platform.assign(count, WaitingQueue());
+    on_platform.assign(count, 0);
+    in_transit.assign(count, 0);
+    platform_state.assign(count, Troon::State::on_platform);
+    platform_timestamp.assign(count, 0);
+    transit_end.assign(count, never);
+}
+
+LinkGroup::LinkGroup(const Network &network, const Partition &partition,
+                     int rank)
+    : start(partition.bounds[rank]), end(partition.bounds[rank + 1]),
+      compute_time(0) {
+    link_states.reset(network, start, end);
+}
+
+void LinkGroup::reset(const Network &network, const Partition &partition,
+                      int rank, std::vector<Troon> &&link_troons) {
+    start = partition.bounds[rank];
+    end = partition.bounds[rank + 1];
+    troons = std::move(link_troons);
+    free_slots.clear();
+
+    // In the order they board, so that every waiting troon is pushed at
+    // the back of its queue
+    std::sort(troons.begin(), troons.end(),
+              [](const Troon &a, const Troon &b) {
+                  if (a.state_timestamp != b.state_timestamp) {
+                      return a.state_timestamp < b.state_timestamp;
+                  }
+
+                  return a.id < b.id;
+              });
+
+    link_states.reset(network, start, end);
+
+    for (uint32_t index = 1; index <= troons.size(); index++) {
+        const Troon &troon = troons[index - 1];
+        assert(has_link(troon.on_link));
+
+        uint32_t i = link_index(troon.on_link);
+        switch (troon.state) {
+            case Troon::State::waiting_platform:
+                enqueue(index);
+                break;
+            case Troon::State::on_platform:
+            case Troon::State::waiting_transit:
+                link_states.on_platform[i] = index;
+                link_states.platform_state[i] = troon.state;
+                link_states.platform_timestamp[i] = troon.state_timestamp;
+                break;
+            case Troon::State::in_transit:
+                link_states.in_transit[i] = index;
+                link_states.transit_end[i] =
+                    troon.state_timestamp + link_states.length[i];
+                break;
+        }
     }
 }
 
@@ -331,12 +883,9 @@ uint32_t LinkGroup::count() const {
     return end - start;
 }
 
-LinkState *LinkGroup::get_link_state(uint32_t link_id) {
-    if (!has_link(link_id)) {
-        return nullptr;
-    }
-
-    return link_states.data() + link_id - start;
+uint32_t LinkGroup::link_index(uint32_t link_id) const {
+    assert(has_link(link_id));
+    return link_id - start;
 }
 
 Troon *LinkGroup::get_troon(uint32_t index) {
@@ -347,148 +896,1498 @@ Troon *LinkGroup::get_troon(uint32_t index) {
     return troons.data() + index - 1;
 }
 
-int link_rank(uint32_t link_id, uint32_t num_proc, uint32_t num_links) {
-    uint32_t quot = num_links / num_proc;
-    if (!quot) {
-        return num_proc - 1;
+uint32_t LinkGroup::add_troon(const Troon &troon) {
+    uint32_t index;
+    if (free_slots.empty()) {
+        troons.push_back(troon);
+        index = troons.size();
+    } else {
+        index = free_slots.back();
+        free_slots.pop_back();
+        troons[index - 1] = troon;
     }
 
-    uint32_t rank = (link_id - 1) / quot;
-    if (rank >= num_proc) {
-        return num_proc - 1;
-    }
+    enqueue(index);
 
-    return rank;
+    return index;
 }
 
-TroonMessage::TroonMessage(const Troon &troon, uint32_t src_link,
-                           uint32_t dst_link)
-    : troon(troon), src_link(src_link), dst_link(dst_link) {}
+void LinkGroup::remove_troon(uint32_t index) {
+    troons[index - 1].on_link = 0;
+    free_slots.push_back(index);
+}
 
-TroonMessage::TroonMessage(uint32_t src_link, uint32_t dst_link)
-    : src_link(src_link), dst_link(dst_link) {}
+std::vector<Troon> LinkGroup::live_troons() const {
+    std::vector<Troon> live;
+    live.reserve(troons.size() - free_slots.size());
+    for (const Troon &troon : troons) {
+        if (troon.on_link) {
+            live.push_back(troon);
+        }
+    }
 
-Network::Network()
-    : ticks(0), num_print_lines(0) {
-    for (size_t i = 0; i < num_lines; i++) {
-        num_line_troons_total[i] = 0;
-        num_line_troons_spawned[i] = 0;
+    return live;
+}
 
-        line_forward_start[i] = 0;
-        line_backward_start[i] = 0;
-    }
+void LinkGroup::enqueue(uint32_t index) {
+    const Troon &troon = troons[index - 1];
+    link_states.waiting_platform[link_index(troon.on_link)].push(index,
+                                                                 troon);
 }
 
-Network::Network(uint32_t num_stations,
-                 std::vector<uint32_t> &popularities, adjacency_matrix &mat,
-                 std::vector<std::string> &station_names,
-                 std::vector<std::string> &green_station_names,
-                 std::vector<std::string> &yellow_station_names,
-                 std::vector<std::string> &blue_station_names,
-                 uint32_t ticks, uint32_t num_green, uint32_t num_yellow,
-                 uint32_t num_blue, uint32_t num_print_lines)
-    : ticks(ticks), num_print_lines(num_print_lines), station_names(station_names) {
-    num_line_troons_total[0] = num_green;
-    num_line_troons_total[1] = num_yellow;
-    num_line_troons_total[2] = num_blue;
+bool LinkGroup::transit_done(uint32_t link_id, uint32_t tick) const {
+    return link_states.transit_end[link_index(link_id)] <= tick;
+}
 
-    num_line_troons_spawned[0] = 0;
-    num_line_troons_spawned[1] = 0;
-    num_line_troons_spawned[2] = 0;
+uint32_t LinkGroup::finish_transit(uint32_t link_id, uint32_t dst_link_id,
+                                   uint32_t tick) {
+    uint32_t i = link_index(link_id);
+    uint32_t index = link_states.in_transit[i];
 
-    stations.resize(num_stations);
-    for (uint32_t i = 0; i < num_stations; i++) {
-        stations[i].popularity = popularities[i];
-    }
+    Troon &troon = troons[index - 1];
+    troon.state = Troon::State::waiting_platform;
+    troon.state_timestamp = tick;
+    troon.on_link = dst_link_id;
 
-    // link_matrix[src][dst] is link: src -> dst
-    adjacency_matrix link_matrix(num_stations,
-                                 std::vector<uint32_t>(num_stations));
+    link_states.in_transit[i] = 0;
+    link_states.transit_end[i] = LinkStates::never;
 
-    std::vector<std::string> *all_line_names[num_lines] =
-        {&green_station_names, &yellow_station_names, &blue_station_names};
+    return index;
+}
 
-    for (size_t line = 0; line < num_lines; line++) {
-        std::vector<std::string> &line_names = *all_line_names[line];
-        uint32_t num_line_stations = line_names.size();
+void LinkGroup::update_platform(uint32_t link_id, uint32_t tick) {
+    uint32_t i = link_index(link_id);
+
+    // Move from platform to link
+    if (link_states.on_platform[i]) {
+        Troon &troon = troons[link_states.on_platform[i] - 1];
+        if (link_states.platform_state[i] == Troon::State::waiting_transit) {
+            troon.state = Troon::State::in_transit;
+            troon.state_timestamp = tick;
+
+            link_states.in_transit[i] = link_states.on_platform[i];
+            link_states.transit_end[i] = tick + link_states.length[i];
+            link_states.on_platform[i] = 0;
+        } else if (!link_states.in_transit[i] &&
+                   tick - link_states.platform_timestamp[i] >
+                       link_states.popularity[i]) {
+            // Finished with opening and closing doors and letting
+            // passengers on
+            troon.state = Troon::State::waiting_transit;
+            troon.state_timestamp = tick;
+
+            link_states.platform_state[i] = troon.state;
+            link_states.platform_timestamp[i] = tick;
+        }
+    }
 
-        uint32_t forward_end_id = 0;
-        uint32_t backward_end_id = 0;
+    // Move from waiting area to platform
+    WaitingQueue &waiting = link_states.waiting_platform[i];
+    if (!link_states.on_platform[i] && !waiting.empty()) {
+        uint32_t index = waiting.top();
+        waiting.pop();
 
-        // Forward
-        {
-            uint32_t prev_link_id = 0;
+        Troon &troon = troons[index - 1];
+        assert(troon.on_link == link_id);
+        troon.state = Troon::State::on_platform;
+        troon.state_timestamp = tick;
 
-            for (uint32_t i = 0; i < num_line_stations - 1; i++) {
-                size_t src = find_index(line_names[i], station_names);
-                size_t dst = find_index(line_names[i + 1], station_names);
+        link_states.on_platform[i] = index;
+        link_states.platform_state[i] = troon.state;
+        link_states.platform_timestamp[i] = tick;
+    }
+}
 
-                uint32_t link_id = add_link(src, dst, mat, link_matrix);
-                Link &link = links[link_id - 1];
+void LinkGroup::shift(uint32_t ticks) {
+    for (Troon &troon : troons) {
+        troon.state_timestamp += ticks;
+    }
 
-                if (!prev_link_id) {
-                    line_forward_start[line] = link_id;
-                } else {
-                    link.prev_link[line] = prev_link_id;
-                    links[prev_link_id - 1].next_link[line] = link_id;
-                }
+    for (uint32_t i = 0; i < count(); i++) {
+        link_states.waiting_platform[i].shift(ticks);
+        if (link_states.on_platform[i]) {
+            link_states.platform_timestamp[i] += ticks;
+        }
+        if (link_states.in_transit[i]) {
+            link_states.transit_end[i] += ticks;
+        }
+    }
+}
 
-                prev_link_id = link_id;
-            }
+// Expected work of a link per tick: a fixed cost for visiting it, plus the
+// troons expected to be on its platform or in transit on it. A troon of a
+// line spends (dwell + length) of every line cycle on each of its links,
+// and a link holds at most one troon on the platform and one in transit.
+// Spawn links also take one spawned troon per tick while spawning
+std::vector<double> link_load(const Network &network) {
+    size_t num_links = network.links.size();
 
-            forward_end_id = prev_link_id;
-        }
+    auto link_time = [&network](const Link &link) {
+        return network.stations[link.src].popularity + 2.0 + link.length;
+    };
 
-        // Backward
-        {
-            uint32_t prev_link_id = 0;
-            for (uint32_t i = num_line_stations - 1; i > 0; i--) {
-                size_t src = find_index(line_names[i], station_names);
-                size_t dst = find_index(line_names[i - 1], station_names);
+    double cycle_time[num_lines] = {};
+    for (size_t line = 0; line < num_lines; line++) {
+        uint32_t start_id = network.line_forward_start[line];
+        if (!start_id) {
+            continue;
+        }
 
-                uint32_t link_id = add_link(src, dst, mat, link_matrix);
-                Link &link = links[link_id - 1];
+        uint32_t link_id = start_id;
+        do {
+            const Link &link = network.links[link_id - 1];
+            cycle_time[line] += link_time(link);
+            link_id = link.next_link[line];
+        } while (link_id && link_id != start_id);
+    }
 
-                if (!prev_link_id) {
-                    line_backward_start[line] = link_id;
-                } else {
-                    link.prev_link[line] = prev_link_id;
-                    links[prev_link_id - 1].next_link[line] = link_id;
-                }
+    std::vector<double> load(num_links, 1.0);
+    for (size_t i = 0; i < num_links; i++) {
+        const Link &link = network.links[i];
 
-                prev_link_id = link_id;
+        double occupancy = 0;
+        for (size_t line = 0; line < num_lines; line++) {
+            if (link.next_link[line] && cycle_time[line] > 0) {
+                occupancy += network.num_line_troons_total[line] *
+                             link_time(link) / cycle_time[line];
             }
-
-            backward_end_id = prev_link_id;
         }
 
-        // Connect forward and backwards links
-        Link &forward_start = links[line_forward_start[line] - 1];
-        Link &backward_start = links[line_backward_start[line] - 1];
-        Link &forward_end = links[forward_end_id - 1];
-        Link &backward_end = links[backward_end_id - 1];
+        load[i] += std::min(occupancy, 2.0);
+    }
 
-        forward_start.prev_link[line] = backward_end_id;
-        backward_start.prev_link[line] = forward_end_id;
+    if (network.ticks) {
+        for (size_t line = 0; line < num_lines; line++) {
+            uint32_t line_total = network.num_line_troons_total[line];
+            uint32_t forward_id = network.line_forward_start[line];
+            uint32_t backward_id = network.line_backward_start[line];
 
-        forward_end.next_link[line] = line_backward_start[line];
-        backward_end.next_link[line] = line_forward_start[line];
+            if (forward_id) {
+                load[forward_id - 1] +=
+                    std::min(line_total - line_total / 2, network.ticks) /
+                    static_cast<double>(network.ticks);
+            }
+            if (backward_id) {
+                load[backward_id - 1] +=
+                    std::min(line_total / 2, network.ticks) /
+                    static_cast<double>(network.ticks);
+            }
+        }
     }
+
+    return load;
 }
 
-uint32_t Network::add_link(size_t src, size_t dst,
-                           const adjacency_matrix &length_mat, adjacency_matrix &link_mat) {
-    uint32_t link_id = link_mat[src][dst];
-    if (link_id) {
-        return link_id;
-    }
+Partition::Partition(int num_proc)
+    : bounds(num_proc + 1) {}
 
-    links.push_back(Link(src, dst, length_mat[src][dst]));
+Partition::Partition(const Network &network, int num_proc)
+    : bounds(num_proc + 1) {
+    balance(link_load(network));
+}
 
-    uint32_t new_link_id = links.size();
-    link_mat[src][dst] = new_link_id;
+bool Partition::rebalance(const std::vector<double> &link_cost) {
+    std::vector<uint32_t> old_bounds = bounds;
+    balance(link_cost);
 
-    return new_link_id;
+    return bounds != old_bounds;
+}
+
+void Partition::balance(const std::vector<double> &load) {
+    int num_proc = bounds.size() - 1;
+    uint32_t num_links = load.size();
+
+    double total_load = 0;
+    for (double link_load : load) {
+        total_load += link_load;
+    }
+
+    // Cut the prefix sums of the load as close as possible to multiples
+    // of the load per rank
+    double rank_load = total_load / num_proc;
+    double prefix_load = 0;
+    uint32_t link_id = 1;
+
+    bounds[0] = 1;
+    for (int rank = 1; rank < num_proc; rank++) {
+        double target = rank * rank_load;
+        while (link_id <= num_links &&
+               prefix_load + load[link_id - 1] / 2 < target) {
+            prefix_load += load[link_id - 1];
+            link_id++;
+        }
+
+        bounds[rank] = link_id;
+    }
+    bounds[num_proc] = num_links + 1;
+
+    update_owners();
+}
+
+void Partition::broadcast(bool renumbered, size_t num_links) {
+    MPI_Bcast(bounds.data(), bounds.size(), MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+
+    if (renumbered) {
+        order.resize(num_links);
+        MPI_Bcast(order.data(), order.size(), MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+    }
+
+    update_owners();
+}
+
+size_t Partition::cut_size(const Network &network) const {
+    size_t cut = 0;
+    for (uint32_t link_id = 1; link_id <= network.links.size(); link_id++) {
+        const Link &link = network.links[link_id - 1];
+
+        for (size_t line = 0; line < num_lines; line++) {
+            uint32_t next_id = link.next_link[line];
+            if (!next_id ||
+                arr_contains(next_id, link.next_link, line)) {
+                continue;
+            }
+
+            cut += link_rank(link_id) != link_rank(next_id);
+        }
+    }
+
+    return cut;
+}
+
+// Undirected graph of the links, two links are adjacent when a line goes
+// from one to the other. Vertices are weighted by load, edges by the
+// number of lines connecting the two links
+struct LinkGraph {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> adjacent;
+    std::vector<uint32_t> edge_weights;
+    std::vector<double> vertex_weights;
+
+    size_t size() const { return vertex_weights.size(); }
+    double total_weight() const;
+};
+
+double LinkGraph::total_weight() const {
+    double total = 0;
+    for (double weight : vertex_weights) {
+        total += weight;
+    }
+
+    return total;
+}
+
+// Builds a graph from an unsorted list of (vertex, vertex, weight) edges,
+// merging duplicates
+LinkGraph make_graph(std::vector<double> &&vertex_weights,
+                     std::vector<std::array<uint32_t, 3>> &edges) {
+    LinkGraph graph;
+    graph.vertex_weights = std::move(vertex_weights);
+    graph.offsets.assign(graph.size() + 1, 0);
+
+    std::sort(edges.begin(), edges.end());
+
+    for (size_t i = 0; i < edges.size(); i++) {
+        const auto &edge = edges[i];
+        if (i && edge[0] == edges[i - 1][0] && edge[1] == edges[i - 1][1]) {
+            graph.edge_weights.back() += edge[2];
+            continue;
+        }
+
+        graph.adjacent.push_back(edge[1]);
+        graph.edge_weights.push_back(edge[2]);
+        graph.offsets[edge[0] + 1]++;
+    }
+
+    for (size_t v = 0; v < graph.size(); v++) {
+        graph.offsets[v + 1] += graph.offsets[v];
+    }
+
+    return graph;
+}
+
+LinkGraph link_graph(const Network &network) {
+    std::vector<std::array<uint32_t, 3>> edges;
+    for (uint32_t i = 0; i < network.links.size(); i++) {
+        for (size_t line = 0; line < num_lines; line++) {
+            uint32_t next_id = network.links[i].next_link[line];
+            if (next_id && next_id - 1 != i) {
+                edges.push_back({i, next_id - 1, 1});
+                edges.push_back({next_id - 1, i, 1});
+            }
+        }
+    }
+
+    return make_graph(link_load(network), edges);
+}
+
+// Heavy edge matching: every vertex is merged with the unmatched neighbour
+// it shares the heaviest edge with. coarse_of maps vertices to the coarse
+// graph
+LinkGraph coarsen_graph(const LinkGraph &graph, double max_vertex_weight,
+                        std::vector<uint32_t> &coarse_of) {
+    constexpr uint32_t unmatched = std::numeric_limits<uint32_t>::max();
+
+    size_t size = graph.size();
+    std::vector<uint32_t> order(size);
+    for (uint32_t v = 0; v < size; v++) {
+        order[v] = v;
+    }
+
+    std::mt19937 rng(size);
+    std::shuffle(order.begin(), order.end(), rng);
+
+    std::vector<uint32_t> match(size, unmatched);
+    for (uint32_t v : order) {
+        if (match[v] != unmatched) {
+            continue;
+        }
+
+        uint32_t best = v;
+        uint32_t best_weight = 0;
+        for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+            uint32_t u = graph.adjacent[e];
+            if (match[u] == unmatched && u != v &&
+                graph.edge_weights[e] > best_weight &&
+                graph.vertex_weights[v] + graph.vertex_weights[u] <=
+                    max_vertex_weight) {
+                best = u;
+                best_weight = graph.edge_weights[e];
+            }
+        }
+
+        match[v] = best;
+        match[best] = v;
+    }
+
+    coarse_of.assign(size, unmatched);
+    uint32_t coarse_size = 0;
+    for (uint32_t v = 0; v < size; v++) {
+        if (coarse_of[v] == unmatched) {
+            coarse_of[v] = coarse_of[match[v]] = coarse_size++;
+        }
+    }
+
+    std::vector<double> vertex_weights(coarse_size);
+    std::vector<std::array<uint32_t, 3>> edges;
+    for (uint32_t v = 0; v < size; v++) {
+        uint32_t c = coarse_of[v];
+        vertex_weights[c] += graph.vertex_weights[v];
+
+        for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+            uint32_t d = coarse_of[graph.adjacent[e]];
+            if (c != d) {
+                edges.push_back({c, d, graph.edge_weights[e]});
+            }
+        }
+    }
+
+    return make_graph(std::move(vertex_weights), edges);
+}
+
+// Weight of the edges between the two sides
+uint64_t bisection_cut(const LinkGraph &graph, const std::vector<uint8_t> &side) {
+    uint64_t cut = 0;
+    for (uint32_t v = 0; v < graph.size(); v++) {
+        for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+            if (side[v] != side[graph.adjacent[e]]) {
+                cut += graph.edge_weights[e];
+            }
+        }
+    }
+
+    return cut / 2;
+}
+
+// Fiduccia-Mattheyses refinement: moves the vertices with the best gain
+// across, keeping the best bisection seen, until a pass stops improving.
+// Side 0 should get target_fraction of the weight, up to the imbalance
+void refine_bisection(const LinkGraph &graph, double target_fraction,
+                      std::vector<uint8_t> &side) {
+    constexpr double max_imbalance = 0.03;
+    constexpr size_t max_pass_moves_without_gain = 64;
+    constexpr int max_passes = 8;
+
+    size_t size = graph.size();
+    double total = graph.total_weight();
+
+    double max_vertex_weight = 0;
+    for (double weight : graph.vertex_weights) {
+        max_vertex_weight = std::max(max_vertex_weight, weight);
+    }
+
+    double limit[2];
+    for (int s = 0; s < 2; s++) {
+        double target = s ? total * (1 - target_fraction)
+                          : total * target_fraction;
+        limit[s] = std::max(target * (1 + max_imbalance),
+                            target + max_vertex_weight / 2);
+    }
+
+    std::vector<int64_t> gain(size);
+    std::vector<uint8_t> locked(size);
+
+    for (int pass = 0; pass < max_passes; pass++) {
+        double weight[2] = {};
+        for (uint32_t v = 0; v < size; v++) {
+            weight[side[v]] += graph.vertex_weights[v];
+
+            gain[v] = 0;
+            for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+                bool external = side[v] != side[graph.adjacent[e]];
+                gain[v] += external ? graph.edge_weights[e]
+                                    : -static_cast<int64_t>(graph.edge_weights[e]);
+            }
+        }
+
+        auto imbalance = [&limit](const double *weight) {
+            return std::max(0.0, weight[0] - limit[0]) +
+                   std::max(0.0, weight[1] - limit[1]);
+        };
+
+        std::priority_queue<std::pair<int64_t, uint32_t>> moves_by_gain;
+        for (uint32_t v = 0; v < size; v++) {
+            locked[v] = 0;
+            if (gain[v] > -static_cast<int64_t>(graph.offsets[v + 1] -
+                                                graph.offsets[v]) ||
+                imbalance(weight) > 0) {
+                moves_by_gain.push({gain[v], v});
+            }
+        }
+
+        int64_t cut = bisection_cut(graph, side);
+        int64_t best_cut = cut;
+        double best_imbalance = imbalance(weight);
+        size_t best_moves = 0;
+        std::vector<uint32_t> moves;
+
+        while (!moves_by_gain.empty() &&
+               moves.size() - best_moves < max_pass_moves_without_gain) {
+            auto [move_gain, v] = moves_by_gain.top();
+            moves_by_gain.pop();
+
+            if (locked[v] || move_gain != gain[v]) {
+                continue;
+            }
+
+            int from = side[v];
+            int to = 1 - from;
+            double vertex_weight = graph.vertex_weights[v];
+
+            // Only move into the lighter side while out of balance
+            bool fixes_balance = weight[from] > limit[from];
+            if (weight[to] + vertex_weight > limit[to] && !fixes_balance) {
+                continue;
+            }
+            if (imbalance(weight) > 0 && !fixes_balance) {
+                continue;
+            }
+
+            side[v] = to;
+            locked[v] = 1;
+            weight[from] -= vertex_weight;
+            weight[to] += vertex_weight;
+            cut -= gain[v];
+            moves.push_back(v);
+
+            for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+                uint32_t u = graph.adjacent[e];
+                int64_t edge_weight = graph.edge_weights[e];
+
+                gain[u] += side[u] == to ? -2 * edge_weight : 2 * edge_weight;
+                if (!locked[u]) {
+                    moves_by_gain.push({gain[u], u});
+                }
+            }
+
+            double current_imbalance = imbalance(weight);
+            if (current_imbalance < best_imbalance ||
+                (current_imbalance == best_imbalance && cut < best_cut)) {
+                best_cut = cut;
+                best_imbalance = current_imbalance;
+                best_moves = moves.size();
+            }
+        }
+
+        // Undo the moves after the best bisection
+        for (size_t i = best_moves; i < moves.size(); i++) {
+            side[moves[i]] = 1 - side[moves[i]];
+        }
+
+        if (!best_moves) {
+            break;
+        }
+    }
+}
+
+// Grows side 0 from a start vertex, always adding the frontier vertex that
+// cuts the fewest edges, until it reaches its share of the weight
+std::vector<uint8_t> grow_bisection(const LinkGraph &graph,
+                                    double target_fraction, uint32_t start) {
+    size_t size = graph.size();
+    double target = graph.total_weight() * target_fraction;
+
+    std::vector<uint8_t> side(size, 1);
+    std::vector<int64_t> gain(size);
+    for (uint32_t v = 0; v < size; v++) {
+        for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+            gain[v] -= graph.edge_weights[e];
+        }
+    }
+
+    std::priority_queue<std::pair<int64_t, uint32_t>> frontier;
+    frontier.push({gain[start], start});
+
+    double weight = 0;
+    uint32_t next_unvisited = 0;
+    while (weight < target) {
+        uint32_t v;
+        if (!frontier.empty()) {
+            auto [vertex_gain, vertex] = frontier.top();
+            frontier.pop();
+
+            if (!side[vertex] || vertex_gain != gain[vertex]) {
+                continue;
+            }
+
+            v = vertex;
+        } else {
+            // The graph is not connected, continue in another component
+            while (next_unvisited < size && !side[next_unvisited]) {
+                next_unvisited++;
+            }
+            if (next_unvisited == size) {
+                break;
+            }
+
+            v = next_unvisited;
+        }
+
+        // Stop if adding the vertex overshoots more than it undershoots
+        double vertex_weight = graph.vertex_weights[v];
+        if (weight > 0 && weight + vertex_weight - target > target - weight) {
+            break;
+        }
+
+        side[v] = 0;
+        weight += vertex_weight;
+
+        for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+            uint32_t u = graph.adjacent[e];
+            gain[u] += 2 * graph.edge_weights[e];
+            if (side[u]) {
+                frontier.push({gain[u], u});
+            }
+        }
+    }
+
+    return side;
+}
+
+// Multilevel bisection: coarsen the graph, bisect the coarsest graph from a
+// few start vertices, then project it back refining at every level
+std::vector<uint8_t> bisect_graph(const LinkGraph &graph,
+                                  double target_fraction) {
+    constexpr size_t coarsest_size = 64;
+    constexpr int num_starts = 4;
+
+    std::vector<LinkGraph> levels;
+    std::vector<std::vector<uint32_t>> coarse_of;
+
+    const LinkGraph *coarsest = &graph;
+    double max_vertex_weight = 1.5 * graph.total_weight() / coarsest_size;
+    while (coarsest->size() > coarsest_size) {
+        std::vector<uint32_t> level_coarse_of;
+        LinkGraph coarse =
+            coarsen_graph(*coarsest, max_vertex_weight, level_coarse_of);
+
+        // Stop once matching hardly shrinks the graph any more
+        if (coarse.size() > coarsest->size() * 0.9) {
+            break;
+        }
+
+        levels.push_back(std::move(coarse));
+        coarse_of.push_back(std::move(level_coarse_of));
+        coarsest = &levels.back();
+    }
+
+    std::vector<uint8_t> side;
+    uint64_t best_cut = std::numeric_limits<uint64_t>::max();
+    for (int i = 0; i < num_starts; i++) {
+        uint32_t start = coarsest->size() * i / num_starts;
+
+        std::vector<uint8_t> start_side =
+            grow_bisection(*coarsest, target_fraction, start);
+        refine_bisection(*coarsest, target_fraction, start_side);
+
+        uint64_t cut = bisection_cut(*coarsest, start_side);
+        if (cut < best_cut) {
+            best_cut = cut;
+            side = std::move(start_side);
+        }
+    }
+
+    for (size_t level = levels.size(); level-- > 0;) {
+        const LinkGraph &fine = level ? levels[level - 1] : graph;
+
+        std::vector<uint8_t> fine_side(fine.size());
+        for (uint32_t v = 0; v < fine.size(); v++) {
+            fine_side[v] = side[coarse_of[level][v]];
+        }
+
+        side = std::move(fine_side);
+        refine_bisection(fine, target_fraction, side);
+    }
+
+    return side;
+}
+
+// Recursive bisection into num_parts parts numbered from first_part,
+// vertices maps the vertices of the graph to link indices
+void partition_graph(const LinkGraph &graph,
+                     const std::vector<uint32_t> &vertices, int first_part,
+                     int num_parts, std::vector<int> &part) {
+    if (num_parts == 1 || !graph.size()) {
+        for (uint32_t link_index : vertices) {
+            part[link_index] = first_part;
+        }
+
+        return;
+    }
+
+    int left_parts = num_parts / 2;
+    std::vector<uint8_t> side =
+        bisect_graph(graph, static_cast<double>(left_parts) / num_parts);
+
+    for (int s = 0; s < 2; s++) {
+        std::vector<uint32_t> sub_index(graph.size());
+        std::vector<uint32_t> sub_vertices;
+        std::vector<double> sub_weights;
+        for (uint32_t v = 0; v < graph.size(); v++) {
+            if (side[v] == s) {
+                sub_index[v] = sub_vertices.size();
+                sub_vertices.push_back(vertices[v]);
+                sub_weights.push_back(graph.vertex_weights[v]);
+            }
+        }
+
+        std::vector<std::array<uint32_t, 3>> sub_edges;
+        for (uint32_t v = 0; v < graph.size(); v++) {
+            if (side[v] != s) {
+                continue;
+            }
+
+            for (uint32_t e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+                uint32_t u = graph.adjacent[e];
+                if (side[u] == s) {
+                    sub_edges.push_back(
+                        {sub_index[v], sub_index[u], graph.edge_weights[e]});
+                }
+            }
+        }
+
+        LinkGraph sub_graph = make_graph(std::move(sub_weights), sub_edges);
+
+        if (s) {
+            partition_graph(sub_graph, sub_vertices, first_part + left_parts,
+                            num_parts - left_parts, part);
+        } else {
+            partition_graph(sub_graph, sub_vertices, first_part, left_parts,
+                            part);
+        }
+    }
+}
+
+Partition Partition::minimize_cut(const Network &network, int num_proc) {
+    Partition partition(num_proc);
+
+    uint32_t num_links = network.links.size();
+    LinkGraph graph = link_graph(network);
+
+    std::vector<uint32_t> vertices(num_links);
+    for (uint32_t i = 0; i < num_links; i++) {
+        vertices[i] = i;
+    }
+
+    std::vector<int> part(num_links);
+    partition_graph(graph, vertices, 0, num_proc, part);
+
+    // Renumber the links part by part, keeping their relative order
+    partition.order.reserve(num_links);
+    partition.bounds[0] = 1;
+    for (int rank = 0; rank < num_proc; rank++) {
+        for (uint32_t i = 0; i < num_links; i++) {
+            if (part[i] == rank) {
+                partition.order.push_back(i + 1);
+            }
+        }
+
+        partition.bounds[rank + 1] = partition.order.size() + 1;
+    }
+
+    partition.update_owners();
+    return partition;
+}
+
+void Partition::update_owners() {
+    int num_proc = bounds.size() - 1;
+
+    owner.assign(bounds[num_proc], 0);
+    for (int rank = 0; rank < num_proc; rank++) {
+        for (uint32_t link_id = bounds[rank]; link_id < bounds[rank + 1];
+             link_id++) {
+            owner[link_id] = rank;
+        }
+    }
+}
+
+int Partition::link_rank(uint32_t link_id) const {
+    return owner[link_id];
+}
+
+InputFile::InputFile(const char *path)
+    : data(nullptr), size(0) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+
+            data = static_cast<char *>(mapped);
+            size = st.st_size;
+        }
+    }
+
+    close(fd);
+}
+
+InputFile::~InputFile() {
+    if (data) {
+        munmap(data, size);
+    }
+}
+
+bool InputFile::is_open() const {
+    return data;
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool is_digit(char c) {
+    return static_cast<unsigned char>(c - '0') < 10;
+}
+
+InputReader::InputReader(const char *begin, const char *end)
+    : pos(begin), end(end) {}
+
+void InputReader::skip_space() {
+    while (pos < end && is_space(*pos)) {
+        pos++;
+    }
+}
+
+uint32_t InputReader::read_uint() {
+    skip_space();
+
+    uint32_t val = 0;
+    while (pos < end && is_digit(*pos)) {
+        val = val * 10 + (*pos - '0');
+        pos++;
+    }
+
+    return val;
+}
+
+std::string_view InputReader::read_word() {
+    skip_space();
+
+    const char *begin = pos;
+    while (pos < end && !is_space(*pos)) {
+        pos++;
+    }
+
+    return std::string_view(begin, pos - begin);
+}
+
+// Returns the rest of the current line, without the line ending
+std::string_view InputReader::read_line() {
+    const char *begin = pos;
+    skip_line();
+
+    const char *line_end = pos;
+    if (line_end > begin && line_end[-1] == '\n') {
+        line_end--;
+    }
+    if (line_end > begin && line_end[-1] == '\r') {
+        line_end--;
+    }
+
+    return std::string_view(begin, line_end - begin);
+}
+
+void InputReader::skip_uint() {
+    skip_space();
+
+    while (pos < end && is_digit(*pos)) {
+        pos++;
+    }
+}
+
+// Moves to the start of the next line, memchr is vectorized which makes
+// this much faster than scanning token by token
+void InputReader::skip_line() {
+    const void *newline = memchr(pos, '\n', end - pos);
+    pos = newline ? static_cast<const char *>(newline) + 1 : end;
+}
+
+SharedWindow::SharedWindow()
+    : win(MPI_WIN_NULL), data(nullptr), writable(true) {}
+
+SharedWindow::SharedWindow(size_t size, MPI_Comm node_comm) {
+    int node_rank;
+    MPI_Comm_rank(node_comm, &node_rank);
+
+    writable = !node_rank;
+
+    MPI_Aint local_size = node_rank ? 0 : size;
+    MPI_Win_allocate_shared(local_size, 1, MPI_INFO_NULL, node_comm, &data,
+                            &win);
+
+    if (node_rank) {
+        MPI_Aint leader_size;
+        int disp_unit;
+        MPI_Win_shared_query(win, 0, &leader_size, &disp_unit, &data);
+    }
+
+    MPI_Win_fence(0, win);
+}
+
+SharedWindow::SharedWindow(SharedWindow &&other)
+    : win(other.win), data(other.data), writable(other.writable) {
+    other.win = MPI_WIN_NULL;
+    other.data = nullptr;
+    other.writable = true;
+}
+
+SharedWindow &SharedWindow::operator=(SharedWindow &&other) {
+    std::swap(win, other.win);
+    std::swap(data, other.data);
+    std::swap(writable, other.writable);
+    return *this;
+}
+
+SharedWindow::~SharedWindow() {
+    if (win != MPI_WIN_NULL) {
+        MPI_Win_free(&win);
+    }
+}
+
+void SharedWindow::sync() const {
+    if (win != MPI_WIN_NULL) {
+        MPI_Win_fence(0, win);
+    }
+}
+
+InputChunk::InputChunk(MPI_File file, int rank, int num_proc)
+    : first_token(0), num_tokens(0) {
+    // Small inputs are not worth splitting, the root reads them alone
+    constexpr MPI_Offset min_chunk_size = 1 << 16;
+
+    MPI_Offset file_size;
+    MPI_File_get_size(file, &file_size);
+
+    MPI_Offset chunk_size =
+        std::max((file_size + num_proc - 1) / num_proc, min_chunk_size);
+    begin = std::min(rank * chunk_size, file_size);
+    end = std::min(begin + chunk_size, file_size);
+
+    // The byte before the range tells whether a token starts at its
+    // beginning
+    offset = begin ? begin - 1 : 0;
+
+    data.resize(end - offset);
+    assert(data.size() <= std::numeric_limits<int>::max());
+    MPI_File_read_at_all(file, offset, data.data(), data.size(), MPI_BYTE,
+                         MPI_STATUS_IGNORE);
+
+    for (size_t i = begin - offset; i < data.size(); i++) {
+        num_tokens += !is_space(data[i]) && (!i || is_space(data[i - 1]));
+    }
+
+    MPI_Exscan(&num_tokens, &first_token, 1, MPI_UINT64_T, MPI_SUM,
+               MPI_COMM_WORLD);
+    if (!rank) {
+        first_token = 0;
+    }
+
+    // The last token continues into the next range, read until its end
+    if (num_tokens && end < file_size && !is_space(data.back())) {
+        std::vector<char> block(1 << 16);
+
+        for (MPI_Offset pos = end; pos < file_size;) {
+            int count = std::min<MPI_Offset>(block.size(), file_size - pos);
+            MPI_File_read_at(file, pos, block.data(), count, MPI_BYTE,
+                             MPI_STATUS_IGNORE);
+
+            auto space =
+                std::find_if(block.begin(), block.begin() + count, is_space);
+            data.insert(data.end(), block.begin(), space);
+            if (space != block.begin() + count) {
+                break;
+            }
+
+            pos += count;
+        }
+    }
+}
+
+bool InputChunk::has_token(uint64_t token) const {
+    return first_token <= token && token < first_token + num_tokens;
+}
+
+const char *InputChunk::find_token(uint64_t token) const {
+    assert(has_token(token));
+
+    const char *pos = data.data() + (begin - offset);
+    const char *data_end = data.data() + data.size();
+    if (begin && !is_space(data[0])) {
+        // The range starts inside a token of the previous range
+        while (pos < data_end && !is_space(*pos)) {
+            pos++;
+        }
+    }
+
+    InputReader reader(pos, data_end);
+    for (uint64_t i = first_token; i < token; i++) {
+        reader.read_word();
+    }
+
+    reader.skip_space();
+    return reader.pos;
+}
+
+InputReader InputChunk::reader_at(uint64_t token) const {
+    return InputReader(find_token(token), data.data() + data.size());
+}
+
+MPI_Offset InputChunk::token_end(uint64_t token) const {
+    InputReader reader = reader_at(token);
+    reader.read_word();
+
+    return offset + (reader.pos - data.data());
+}
+
+std::string_view InputChunk::bytes(MPI_Offset from, MPI_Offset to) const {
+    from = std::max(from, begin);
+    to = std::min(to, end);
+
+    if (from >= to) {
+        return std::string_view();
+    }
+
+    return std::string_view(data.data() + (from - offset), to - from);
+}
+
+Options::Options()
+    : input_path(nullptr), graph_partition(false), rebalance_interval(0),
+      lookahead(false), exchange(Exchange::p2p), num_threads(1),
+      shared_engine(false), event_driven(false),
+      fast_forward(false) {}
+
+// Parses [options] <input_file>, returns false on invalid arguments
+bool parse_options(int argc, char *argv[], Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+
+        if (arg == "--partition=graph") {
+            options.graph_partition = true;
+        } else if (arg == "--partition=load") {
+            options.graph_partition = false;
+        } else if (arg == "--lookahead") {
+            options.lookahead = true;
+        } else if (arg == "--exchange=p2p") {
+            options.exchange = Options::Exchange::p2p;
+        } else if (arg == "--exchange=neighbor") {
+            options.exchange = Options::Exchange::neighbor;
+        } else if (arg == "--exchange=rma") {
+            options.exchange = Options::Exchange::rma;
+        } else if (arg == "--event-driven") {
+            options.event_driven = true;
+        } else if (arg == "--fast-forward") {
+            options.fast_forward = true;
+        } else if (arg == "--engine=threads") {
+            options.shared_engine = true;
+        } else if (arg == "--engine=mpi") {
+            options.shared_engine = false;
+        } else if (arg.substr(0, 10) == "--threads=") {
+            char *end;
+            options.num_threads = strtol(argv[i] + 10, &end, 10);
+            if (*end || end == argv[i] + 10 || options.num_threads < 1) {
+                return false;
+            }
+        } else if (arg.substr(0, 12) == "--rebalance=") {
+            char *end;
+            options.rebalance_interval = strtoul(argv[i] + 12, &end, 10);
+            if (*end || end == argv[i] + 12) {
+                return false;
+            }
+        } else if (arg.substr(0, 2) != "--" && !options.input_path) {
+            options.input_path = argv[i];
+        } else {
+            return false;
+        }
+    }
+
+    return options.input_path;
+}
+
+// The lookahead mode and the threads engine run loops of their own. Returns
+// an option given with them that only the tick by tick MPI engine uses, or
+// nullptr
+const char *unsupported_option(const Options &options) {
+    if (!options.lookahead && !options.shared_engine) {
+        return nullptr;
+    }
+
+    if (options.event_driven) {
+        return "--event-driven";
+    }
+    if (options.fast_forward) {
+        return "--fast-forward";
+    }
+    if (options.rebalance_interval) {
+        return "--rebalance";
+    }
+    if (options.exchange != Options::Exchange::p2p) {
+        return "--exchange";
+    }
+
+    if (options.shared_engine) {
+        if (options.lookahead) {
+            return "--lookahead";
+        }
+        if (options.graph_partition) {
+            return "--partition=graph";
+        }
+    } else if (options.num_threads > 1) {
+        return "--threads";
+    }
+
+    return nullptr;
+}
+
+Network::Network()
+    : ticks(0), num_print_lines(0) {
+    for (size_t i = 0; i < num_lines; i++) {
+        num_line_troons_total[i] = 0;
+        num_line_troons_spawned[i] = 0;
+
+        line_forward_start[i] = 0;
+        line_backward_start[i] = 0;
+    }
+}
+
+Network::Network(uint32_t num_stations,
+                 std::vector<uint32_t> &popularities,
+                 std::vector<std::string_view> &names,
+                 std::vector<uint32_t> &green_stations,
+                 std::vector<uint32_t> &yellow_stations,
+                 std::vector<uint32_t> &blue_stations,
+                 uint32_t ticks, uint32_t num_green, uint32_t num_yellow,
+                 uint32_t num_blue, uint32_t num_print_lines)
+    : ticks(ticks), num_print_lines(num_print_lines) {
+    set_station_names(names);
+
+    num_line_troons_total[0] = num_green;
+    num_line_troons_total[1] = num_yellow;
+    num_line_troons_total[2] = num_blue;
+
+    num_line_troons_spawned[0] = 0;
+    num_line_troons_spawned[1] = 0;
+    num_line_troons_spawned[2] = 0;
+
+    station_storage.resize(num_stations);
+    use_storage();
+
+    for (uint32_t i = 0; i < num_stations; i++) {
+        stations[i].popularity = popularities[i];
+    }
+
+    // link_ids[src << 32 | dst] is link: src -> dst. Only the links used by
+    // the lines are stored, the lengths are filled in by read_link_lengths
+    std::unordered_map<uint64_t, uint32_t> link_ids;
+
+    std::vector<uint32_t> *all_line_stations[num_lines] =
+        {&green_stations, &yellow_stations, &blue_stations};
+
+    link_ids.reserve(2 * (green_stations.size() + yellow_stations.size() +
+                          blue_stations.size()));
+
+    for (size_t line = 0; line < num_lines; line++) {
+        std::vector<uint32_t> &line_stations = *all_line_stations[line];
+        uint32_t num_line_stations = line_stations.size();
+
+        uint32_t forward_end_id = 0;
+        uint32_t backward_end_id = 0;
+
+        // Forward
+        {
+            uint32_t prev_link_id = 0;
+
+            for (uint32_t i = 0; i < num_line_stations - 1; i++) {
+                size_t src = line_stations[i];
+                size_t dst = line_stations[i + 1];
+
+                uint32_t link_id = add_link(src, dst, link_ids);
+                Link &link = links[link_id - 1];
+
+                if (!prev_link_id) {
+                    line_forward_start[line] = link_id;
+                } else {
+                    link.prev_link[line] = prev_link_id;
+                    links[prev_link_id - 1].next_link[line] = link_id;
+                }
+
+                prev_link_id = link_id;
+            }
+
+            forward_end_id = prev_link_id;
+        }
+
+        // Backward
+        {
+            uint32_t prev_link_id = 0;
+            for (uint32_t i = num_line_stations - 1; i > 0; i--) {
+                size_t src = line_stations[i];
+                size_t dst = line_stations[i - 1];
+
+                uint32_t link_id = add_link(src, dst, link_ids);
+                Link &link = links[link_id - 1];
+
+                if (!prev_link_id) {
+                    line_backward_start[line] = link_id;
+                } else {
+                    link.prev_link[line] = prev_link_id;
+                    links[prev_link_id - 1].next_link[line] = link_id;
+                }
+
+                prev_link_id = link_id;
+            }
+
+            backward_end_id = prev_link_id;
+        }
+
+        // Connect forward and backwards links
+        Link &forward_start = links[line_forward_start[line] - 1];
+        Link &backward_start = links[line_backward_start[line] - 1];
+        Link &forward_end = links[forward_end_id - 1];
+        Link &backward_end = links[backward_end_id - 1];
+
+        forward_start.prev_link[line] = backward_end_id;
+        backward_start.prev_link[line] = forward_end_id;
+
+        forward_end.next_link[line] = line_backward_start[line];
+        backward_end.next_link[line] = line_forward_start[line];
+    }
+}
+
+Network::Network(std::unique_ptr<InputFile> file)
+    : source(std::move(file)) {
+    const NetworkFileHeader *header =
+        reinterpret_cast<const NetworkFileHeader *>(source->data);
+
+    size_t num_stations = header->num_stations;
+    size_t num_links = header->num_links;
+
+    size_t expected_size = sizeof(NetworkFileHeader) +
+                           num_stations * sizeof(Station) +
+                           num_links * sizeof(Link) +
+                           (num_stations + 1) * sizeof(uint32_t) +
+                           header->names_size;
+
+    if (header->version != NetworkFileHeader::file_version ||
+        source->size < expected_size) {
+        std::cerr << "Unsupported or truncated network file\n";
+        std::exit(2);
+    }
+
+    for (size_t i = 0; i < num_lines; i++) {
+        line_forward_start[i] = header->line_forward_start[i];
+        line_backward_start[i] = header->line_backward_start[i];
+
+        num_line_troons_total[i] = header->num_line_troons_total[i];
+        num_line_troons_spawned[i] = 0;
+    }
+
+    ticks = header->ticks;
+    num_print_lines = header->num_print_lines;
+
+    char *pos = source->data + sizeof(NetworkFileHeader);
+
+    stations = ArrayView<Station>(reinterpret_cast<Station *>(pos), num_stations);
+    pos += num_stations * sizeof(Station);
+
+    links = ArrayView<Link>(reinterpret_cast<Link *>(pos), num_links);
+    pos += num_links * sizeof(Link);
+
+    const uint32_t *name_offsets = reinterpret_cast<const uint32_t *>(pos);
+    pos += (num_stations + 1) * sizeof(uint32_t);
+
+    station_names.reserve(num_stations);
+    for (size_t i = 0; i < num_stations; i++) {
+        station_names.emplace_back(pos + name_offsets[i],
+                                   name_offsets[i + 1] - name_offsets[i]);
+    }
+}
+
+Network::Network(Network &&) = default;
+
+Network &Network::operator=(Network &&) = default;
+
+Network::~Network() = default;
+
+bool NetworkFileHeader::matches(const InputFile &file) {
+    return file.size >= sizeof(NetworkFileHeader) &&
+           memcmp(file.data, file_magic, sizeof(file_magic)) == 0;
+}
+
+void Network::write_binary(const char *path) const {
+    std::ofstream ofs(path, std::ios_base::out | std::ios_base::binary);
+    if (!ofs.is_open()) {
+        std::cerr << "Failed to open " << path << '\n';
+        std::exit(2);
+    }
+
+    uint32_t num_stations = stations.size();
+
+    std::vector<uint32_t> name_offsets(num_stations + 1);
+    for (uint32_t i = 0; i < num_stations; i++) {
+        name_offsets[i + 1] = name_offsets[i] + station_names[i].size();
+    }
+
+    NetworkFileHeader header;
+    memcpy(header.magic, NetworkFileHeader::file_magic, sizeof(header.magic));
+    header.version = NetworkFileHeader::file_version;
+    header.num_stations = num_stations;
+    header.num_links = links.size();
+
+    for (size_t i = 0; i < num_lines; i++) {
+        header.line_forward_start[i] = line_forward_start[i];
+        header.line_backward_start[i] = line_backward_start[i];
+        header.num_line_troons_total[i] = num_line_troons_total[i];
+    }
+
+    header.ticks = ticks;
+    header.num_print_lines = num_print_lines;
+    header.names_size = name_offsets[num_stations];
+
+    ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char *>(stations.data()),
+              stations.size() * sizeof(Station));
+    ofs.write(reinterpret_cast<const char *>(links.data()),
+              links.size() * sizeof(Link));
+    ofs.write(reinterpret_cast<const char *>(name_offsets.data()),
+              name_offsets.size() * sizeof(uint32_t));
+
+    for (auto name : station_names) {
+        ofs.write(name.data(), name.size());
+    }
+
+    if (!ofs) {
+        std::cerr << "Failed to write " << path << '\n';
+        std::exit(2);
+    }
+}
+
+// Collectively reads a compiled network file with MPI-IO into the shared
+// topology. Only the node leaders read it, the root has it mapped already
+void Network::read_binary(MPI_File file, MPI_Comm node_comm,
+                          MPI_Comm leader_comm, int rank) {
+    NetworkFileHeader header;
+    MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE,
+                         MPI_STATUS_IGNORE);
+
+    for (size_t i = 0; i < num_lines; i++) {
+        line_forward_start[i] = header.line_forward_start[i];
+        line_backward_start[i] = header.line_backward_start[i];
+
+        num_line_troons_total[i] = header.num_line_troons_total[i];
+        num_line_troons_spawned[i] = 0;
+    }
+
+    ticks = header.ticks;
+    num_print_lines = header.num_print_lines;
+
+    ArrayView<Station> mapped_stations = stations;
+    ArrayView<Link> mapped_links = links;
+
+    use_shared_storage(header.num_stations, header.num_links, node_comm);
+
+    bool reads = leader_comm != MPI_COMM_NULL && rank;
+    if (!rank) {
+        std::copy(mapped_stations.begin(), mapped_stations.end(),
+                  stations.begin());
+        std::copy(mapped_links.begin(), mapped_links.end(), links.begin());
+    }
+
+    MPI_Offset offset = sizeof(NetworkFileHeader);
+    MPI_File_read_at_all(file, offset, stations.data(),
+                         reads ? stations.size() * sizeof(Station) : 0,
+                         MPI_BYTE, MPI_STATUS_IGNORE);
+
+    offset += header.num_stations * sizeof(Station);
+    MPI_File_read_at_all(file, offset, links.data(),
+                         reads ? links.size() * sizeof(Link) : 0, MPI_BYTE,
+                         MPI_STATUS_IGNORE);
+
+    sync_shared();
+}
+
+void Network::set_station_names(const std::vector<std::string_view> &names) {
+    size_t num_stations = names.size();
+
+    std::vector<size_t> name_offsets(num_stations + 1);
+    for (size_t i = 0; i < num_stations; i++) {
+        name_storage.insert(name_storage.end(), names[i].begin(),
+                            names[i].end());
+        name_offsets[i + 1] = name_storage.size();
+    }
+
+    station_names.clear();
+    station_names.reserve(num_stations);
+    for (size_t i = 0; i < num_stations; i++) {
+        station_names.emplace_back(name_storage.data() + name_offsets[i],
+                                   name_offsets[i + 1] - name_offsets[i]);
+    }
+}
+
+// Points the topology at a window shared by the ranks of the node, the
+// node leader has to fill it in
+void Network::use_shared_storage(uint32_t num_stations, uint32_t num_links,
+                                 MPI_Comm node_comm) {
+    size_t stations_size = num_stations * sizeof(Station);
+    size_t links_size = num_links * sizeof(Link);
+
+    shared_storage = SharedWindow(stations_size + links_size, node_comm);
+
+    stations = ArrayView<Station>(
+        reinterpret_cast<Station *>(shared_storage.data), num_stations);
+    links = ArrayView<Link>(
+        reinterpret_cast<Link *>(shared_storage.data + stations_size),
+        num_links);
+}
+
+void Network::sync_shared() const {
+    shared_storage.sync();
+}
+
+// Gives link order[i] the id i + 1. Only the node leader rewrites the shared
+// topology, collective over the node
+void Network::renumber(const std::vector<uint32_t> &order) {
+    std::vector<uint32_t> new_id(links.size() + 1);
+    for (size_t i = 0; i < order.size(); i++) {
+        new_id[order[i]] = i + 1;
+    }
+
+    for (size_t line = 0; line < num_lines; line++) {
+        line_forward_start[line] = new_id[line_forward_start[line]];
+        line_backward_start[line] = new_id[line_backward_start[line]];
+    }
+
+    if (shared_storage.writable) {
+        std::vector<Link> old_links(links.begin(), links.end());
+
+        for (size_t i = 0; i < order.size(); i++) {
+            Link link = old_links[order[i] - 1];
+            for (size_t line = 0; line < num_lines; line++) {
+                link.next_link[line] = new_id[link.next_link[line]];
+                link.prev_link[line] = new_id[link.prev_link[line]];
+            }
+
+            links[i] = link;
+        }
+    }
+
+    sync_shared();
+}
+
+void Network::use_storage() {
+    stations = ArrayView<Station>(station_storage.data(), station_storage.size());
+    links = ArrayView<Link>(link_storage.data(), link_storage.size());
+}
+
+uint32_t Network::add_link(size_t src, size_t dst,
+                           std::unordered_map<uint64_t, uint32_t> &link_ids) {
+    uint64_t key = static_cast<uint64_t>(src) << 32 | dst;
+
+    auto it = link_ids.find(key);
+    if (it != link_ids.end()) {
+        return it->second;
+    }
+
+    link_storage.push_back(Link(src, dst, 0));
+    use_storage();
+
+    uint32_t new_link_id = links.size();
+    link_ids.emplace(key, new_link_id);
+
+    return new_link_id;
+}
+
+// Streams the entries [first_entry, first_entry + num_entries) of the
+// adjacency matrix in row major order and keeps only the lengths of the
+// links, the reader has to be before the first of them. Entries are read
+// as numbers, however the rows are split into lines
+void Network::read_link_lengths(InputReader &reader, uint64_t first_entry,
+                                uint64_t num_entries) {
+    uint32_t num_links = links.size();
+    uint64_t num_stations = stations.size();
+
+    auto entry = [this, num_stations](uint32_t link_id) {
+        const Link &link = links[link_id - 1];
+        return link.src * num_stations + link.dst;
+    };
+
+    // Link ids sorted by their entry, so that the links are visited in the
+    // same order as the matrix is read
+    std::vector<uint32_t> sorted_links(num_links);
+    for (uint32_t i = 0; i < num_links; i++) {
+        sorted_links[i] = i + 1;
+    }
+
+    std::sort(sorted_links.begin(), sorted_links.end(),
+              [&entry](uint32_t a, uint32_t b) {
+                  return entry(a) < entry(b);
+              });
+
+    size_t next = std::lower_bound(sorted_links.begin(), sorted_links.end(),
+                                   first_entry,
+                                   [&entry](uint32_t link_id, uint64_t e) {
+                                       return entry(link_id) < e;
+                                   }) -
+                  sorted_links.begin();
+
+    uint64_t end_entry = first_entry + num_entries;
+    for (uint64_t position = first_entry; next < num_links; next++) {
+        uint64_t link_entry = entry(sorted_links[next]);
+        if (link_entry >= end_entry) {
+            break;
+        }
+
+        for (; position < link_entry; position++) {
+            reader.skip_uint();
+        }
+
+        links[sorted_links[next] - 1].length = reader.read_uint();
+        position++;
+    }
 }
 
 void Network::print() const {
@@ -498,557 +2397,2024 @@ void Network::print() const {
     std::cout << "Blue troons: " << num_line_troons_total[2] << '\n';
     std::cout << "Print lines: " << num_print_lines << '\n';
 
-    size_t num_stations = stations.size();
+    size_t num_stations = stations.size();
+
+    std::cout << "\nStations: ";
+    for (size_t i = 0; i < num_stations; i++) {
+        std::cout << station_names[i] << " (" << stations[i].popularity << ")";
+
+        if (i != num_stations - 1) {
+            std::cout << ", ";
+        }
+    }
+    std::cout << "\n\n";
+
+    const char *line_names[num_lines] = {"Green", "Yellow", "Blue"};
+    for (size_t line = 0; line < num_lines; line++) {
+        std::cout << line_names[line] << " line: ";
+
+        const Link *link = &links[line_forward_start[line] - 1];
+        std::cout << station_names[link->src];
+
+        uint32_t next_link_id;
+        do {
+            std::cout << " -> " << station_names[link->dst];
+
+            next_link_id = link->next_link[line];
+            link = &links[next_link_id - 1];
+        } while (next_link_id != line_forward_start[line]);
+
+        std::cout << '\n';
+    }
+}
+
+// The header and the packed stations and links are sent in two broadcasts,
+// names stay on the root since only the root prints. Only one rank per
+// node receives the topology, into memory shared with the rest of the node
+void Network::broadcast(MPI_Comm node_comm, MPI_Comm leader_comm) {
+    int stations_size;
+    int links_size;
+    MPI_Pack_size(stations.size(), Station::datatype, MPI_COMM_WORLD,
+                  &stations_size);
+    MPI_Pack_size(links.size(), Link::datatype, MPI_COMM_WORLD, &links_size);
+
+    const int num_vals = 14;
+    uint32_t vals[num_vals];
+
+    vals[0] = stations.size();
+    vals[1] = links.size();
+
+    vals[2] = line_forward_start[0];
+    vals[3] = line_forward_start[1];
+    vals[4] = line_forward_start[2];
+
+    vals[5] = line_backward_start[0];
+    vals[6] = line_backward_start[1];
+    vals[7] = line_backward_start[2];
+
+    vals[8] = ticks;
+    vals[9] = num_line_troons_total[0];
+    vals[10] = num_line_troons_total[1];
+    vals[11] = num_line_troons_total[2];
+    vals[12] = num_print_lines;
+
+    vals[13] = stations_size + links_size;
+
+    std::vector<char> buffer(vals[13]);
+    int position = 0;
+    MPI_Pack(stations.data(), stations.size(), Station::datatype,
+             buffer.data(), buffer.size(), &position, MPI_COMM_WORLD);
+    MPI_Pack(links.data(), links.size(), Link::datatype, buffer.data(),
+             buffer.size(), &position, MPI_COMM_WORLD);
+
+    MPI_Bcast(&vals, num_vals, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+
+    use_shared_storage(vals[0], vals[1], node_comm);
+    std::copy(station_storage.begin(), station_storage.end(), stations.begin());
+    std::copy(link_storage.begin(), link_storage.end(), links.begin());
+
+    std::vector<Station>().swap(station_storage);
+    std::vector<Link>().swap(link_storage);
+
+    MPI_Bcast(buffer.data(), buffer.size(), MPI_PACKED, 0, leader_comm);
+
+    sync_shared();
+}
+
+void Network::receive(MPI_Comm node_comm, MPI_Comm leader_comm) {
+    const int num_vals = 14;
+    uint32_t vals[num_vals];
+    MPI_Bcast(&vals, num_vals, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+
+    uint32_t num_stations = vals[0];
+    uint32_t num_links = vals[1];
+
+    line_forward_start[0] = vals[2];
+    line_forward_start[1] = vals[3];
+    line_forward_start[2] = vals[4];
+
+    line_backward_start[0] = vals[5];
+    line_backward_start[1] = vals[6];
+    line_backward_start[2] = vals[7];
+
+    ticks = vals[8];
+    num_line_troons_total[0] = vals[9];
+    num_line_troons_total[1] = vals[10];
+    num_line_troons_total[2] = vals[11];
+    num_print_lines = vals[12];
+
+    use_shared_storage(num_stations, num_links, node_comm);
+
+    if (leader_comm != MPI_COMM_NULL) {
+        std::vector<char> buffer(vals[13]);
+        MPI_Bcast(buffer.data(), buffer.size(), MPI_PACKED, 0, leader_comm);
+
+        int position = 0;
+        MPI_Unpack(buffer.data(), buffer.size(), &position, stations.data(),
+                   stations.size(), Station::datatype, MPI_COMM_WORLD);
+        MPI_Unpack(buffer.data(), buffer.size(), &position, links.data(),
+                   links.size(), Link::datatype, MPI_COMM_WORLD);
+    }
+
+    sync_shared();
+}
+
+size_t Network::troon_count() const {
+    size_t count = 0;
+    for (size_t line = 0; line < num_lines; line++) {
+        count += num_line_troons_spawned[line];
+    }
+
+    return count;
+}
+
+const Station *Network::src(uint32_t link_id) const {
+    return stations.data() + links[link_id - 1].src;
+}
+
+const Station *Network::dst(uint32_t link_id) const {
+    return stations.data() + links[link_id - 1].dst;
+}
+
+void spawn_troons(Network &network, LinkGroup &link_group, uint32_t tick) {
+    for (size_t line = 0; line < num_lines; line++) {
+        size_t spawned_line = network.num_line_troons_spawned[line];
+        size_t line_total = network.num_line_troons_total[line];
+        size_t left_to_spawn = line_total - spawned_line;
+
+        size_t troon_count = network.troon_count();
+
+        uint32_t forward_link_id = network.line_forward_start[line];
+        uint32_t backward_link_id = network.line_backward_start[line];
+
+        if (left_to_spawn > 0 &&
+            link_group.has_link(forward_link_id)) {
+            Troon troon(troon_count, line, tick, forward_link_id);
+            link_group.add_troon(troon);
+        }
+        if (left_to_spawn > 1 &&
+            link_group.has_link(backward_link_id)) {
+            Troon troon(troon_count + 1, line, tick, backward_link_id);
+            link_group.add_troon(troon);
+        }
+
+        network.num_line_troons_spawned[line] =
+            std::min(spawned_line + 2, line_total);
+    }
+}
+
+void send_all_troons(const std::vector<Troon> &troons) {
+    int my_count = troons.size();
+    MPI_Gather(&my_count, 1, MPI_INT, NULL, 0, MPI_INT, 0, MPI_COMM_WORLD);
+
+    MPI_Gatherv(troons.data(), my_count, Troon::datatype, nullptr,
+                nullptr, nullptr, Troon::datatype, 0, MPI_COMM_WORLD);
+}
+
+void gather_all_troons(const std::vector<Troon> &troons, int num_proc,
+                       std::vector<Troon> &out) {
+    std::vector<int> troon_counts(num_proc);
+    std::vector<int> offsets(num_proc);
+
+    int my_count = troons.size();
+    MPI_Gather(&my_count, 1, MPI_INT, troon_counts.data(), 1, MPI_INT, 0,
+               MPI_COMM_WORLD);
+
+    int total_count = troon_counts[0];
+
+    for (int i = 1; i < num_proc; i++) {
+        offsets[i] = troon_counts[i - 1] + offsets[i - 1];
+        total_count += troon_counts[i];
+    }
+
+    out.resize(total_count);
+
+    MPI_Gatherv(troons.data(), my_count, Troon::datatype, out.data(),
+                troon_counts.data(), offsets.data(), Troon::datatype, 0,
+                MPI_COMM_WORLD);
+}
+
+TickExchange::TickExchange(const Network &network,
+                           const Partition &partition,
+                           const LinkGroup &link_group, int rank,
+                           Options::Exchange mode)
+    : mode(mode), neighbor_comm(MPI_COMM_NULL), inbox_win(MPI_WIN_NULL),
+      inbox(nullptr), send_group(MPI_GROUP_NULL),
+      receive_group(MPI_GROUP_NULL),
+      send_index(partition.bounds.size() - 1, -1) {
+    std::vector<int> receive_index(send_index.size(), -1);
+    std::vector<uint32_t> prev_links;
+
+    for (uint32_t link_id = link_group.start; link_id < link_group.end;
+         link_id++) {
+        const Link &link = network.links[link_id - 1];
+        bool is_boundary = false;
+
+        int dst_ranks[num_lines];
+        for (size_t line = 0; line < num_lines; line++) {
+            dst_ranks[line] = rank;
+            if (link.next_link[line]) {
+                dst_ranks[line] = partition.link_rank(link.next_link[line]);
+            }
+
+            int dst_rank = dst_ranks[line];
+            if (dst_rank != rank &&
+                std::find(dst_ranks, dst_ranks + line, dst_rank) ==
+                    dst_ranks + line) {
+                if (send_index[dst_rank] < 0) {
+                    send_index[dst_rank] = send_ranks.size();
+                    send_ranks.push_back(dst_rank);
+                    send_capacity.push_back(0);
+                }
+
+                send_capacity[send_index[dst_rank]]++;
+            }
+
+            if (link.prev_link[line] &&
+                partition.link_rank(link.prev_link[line]) != rank) {
+                prev_links.push_back(link.prev_link[line]);
+                is_boundary = true;
+            }
+        }
+
+        if (is_boundary) {
+            boundary_links.push_back(link_id);
+        } else {
+            interior_links.push_back(link_id);
+        }
+    }
+
+    std::sort(prev_links.begin(), prev_links.end());
+    prev_links.erase(std::unique(prev_links.begin(), prev_links.end()),
+                     prev_links.end());
+
+    for (uint32_t link_id : prev_links) {
+        int src_rank = partition.link_rank(link_id);
+        if (receive_index[src_rank] < 0) {
+            receive_index[src_rank] = receive_ranks.size();
+            receive_ranks.push_back(src_rank);
+            receive_capacity.push_back(0);
+        }
+
+        receive_capacity[receive_index[src_rank]]++;
+    }
+
+    size_t num_send = send_ranks.size();
+    size_t num_receive = receive_ranks.size();
+
+    receive_links.resize(num_receive);
+    num_inputs.resize(boundary_links.size());
+    for (uint32_t i = 0; i < boundary_links.size(); i++) {
+        const Link &link = network.links[boundary_links[i] - 1];
+
+        for (size_t line = 0; line < num_lines; line++) {
+            if (!link.prev_link[line]) {
+                continue;
+            }
+
+            int src_rank = partition.link_rank(link.prev_link[line]);
+            if (src_rank == rank) {
+                continue;
+            }
+
+            std::vector<uint32_t> &links = receive_links[receive_index[src_rank]];
+            if (links.empty() || links.back() != i) {
+                links.push_back(i);
+                num_inputs[i]++;
+            }
+        }
+    }
+    missing_inputs.resize(boundary_links.size());
+    num_received = 0;
+    receiving = false;
+
+    send_offsets.resize(num_send);
+    send_counts.resize(num_send);
+    send_headers.resize(num_send);
+    for (size_t i = 1; i < num_send; i++) {
+        send_offsets[i] = send_offsets[i - 1] + send_capacity[i - 1];
+    }
+    send_buffer.resize(num_send ? send_offsets.back() + send_capacity.back()
+                                : 0);
+
+    receive_offsets.resize(num_receive);
+    for (size_t i = 1; i < num_receive; i++) {
+        receive_offsets[i] = receive_offsets[i - 1] + receive_capacity[i - 1];
+    }
+    receive_buffer.resize(
+        num_receive ? receive_offsets.back() + receive_capacity.back() : 0);
+
+    if (mode == Options::Exchange::neighbor) {
+        receive_counts.resize(num_receive);
+        requests.resize(1, MPI_REQUEST_NULL);
+        MPI_Dist_graph_create_adjacent(
+            MPI_COMM_WORLD, num_receive, receive_ranks.data(),
+            MPI_UNWEIGHTED, num_send, send_ranks.data(), MPI_UNWEIGHTED,
+            MPI_INFO_NULL, 0, &neighbor_comm);
+        return;
+    }
+
+    if (mode == Options::Exchange::rma) {
+        create_inbox();
+        return;
+    }
+
+    // The same messages every tick, always all the slots so the requests
+    // can be reused. Only the counted troons are read
+    receive_headers.resize(num_receive);
+    requests.resize(num_receive + num_send);
+    for (size_t i = 0; i < num_receive; i++) {
+        message_types.push_back(
+            message_type(&receive_headers[i],
+                         receive_buffer.data() + receive_offsets[i],
+                         receive_capacity[i]));
+        MPI_Recv_init(MPI_BOTTOM, 1, message_types.back(), receive_ranks[i],
+                      troon_tag, MPI_COMM_WORLD, &requests[i]);
+    }
+    for (size_t i = 0; i < num_send; i++) {
+        message_types.push_back(message_type(
+            &send_headers[i], send_buffer.data() + send_offsets[i],
+            send_capacity[i]));
+        MPI_Send_init(MPI_BOTTOM, 1, message_types.back(), send_ranks[i],
+                      troon_tag, MPI_COMM_WORLD, &requests[num_receive + i]);
+    }
+}
+
+// A troon count followed by capacity troons, at their addresses
+MPI_Datatype TickExchange::message_type(uint32_t *count, Troon *troons,
+                                        int capacity) {
+    int block_lengths[2] = {1, capacity};
+    MPI_Aint addresses[2];
+    MPI_Get_address(count, &addresses[0]);
+    MPI_Get_address(troons, &addresses[1]);
+    MPI_Datatype types[2] = {MPI_UNSIGNED, Troon::datatype};
+
+    MPI_Datatype type;
+    MPI_Type_create_struct(2, block_lengths, addresses, types, &type);
+    MPI_Type_commit(&type);
+
+    return type;
+}
+
+// Collective, every rank tells its receive ranks where their block is
+void TickExchange::create_inbox() {
+    size_t num_send = send_ranks.size();
+    size_t num_receive = receive_ranks.size();
+
+    MPI_Aint inbox_size = 0;
+    inbox_offsets.resize(num_receive);
+    for (size_t i = 0; i < num_receive; i++) {
+        inbox_offsets[i] = inbox_size;
+        inbox_size += sizeof(uint32_t) + receive_capacity[i] * sizeof(Troon);
+    }
+
+    MPI_Win_allocate(inbox_size, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &inbox,
+                     &inbox_win);
+
+    target_offsets.resize(num_send);
+    std::vector<MPI_Request> offset_requests(num_send + num_receive);
+    for (size_t i = 0; i < num_send; i++) {
+        MPI_Irecv(&target_offsets[i], 1, MPI_AINT, send_ranks[i], inbox_tag,
+                  MPI_COMM_WORLD, &offset_requests[i]);
+    }
+    for (size_t i = 0; i < num_receive; i++) {
+        MPI_Isend(&inbox_offsets[i], 1, MPI_AINT, receive_ranks[i],
+                  inbox_tag, MPI_COMM_WORLD, &offset_requests[num_send + i]);
+    }
+    MPI_Waitall(offset_requests.size(), offset_requests.data(),
+                MPI_STATUSES_IGNORE);
+
+    MPI_Group world_group;
+    MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+    MPI_Group_incl(world_group, num_send, send_ranks.data(), &send_group);
+    MPI_Group_incl(world_group, num_receive, receive_ranks.data(),
+                   &receive_group);
+    MPI_Group_free(&world_group);
+}
+
+TickExchange::TickExchange(TickExchange &&other)
+    : mode(other.mode), neighbor_comm(MPI_COMM_NULL),
+      inbox_win(MPI_WIN_NULL), inbox(nullptr), send_group(MPI_GROUP_NULL),
+      receive_group(MPI_GROUP_NULL) {
+    swap(other);
+}
+
+TickExchange &TickExchange::operator=(TickExchange &&other) {
+    swap(other);
+    return *this;
+}
+
+TickExchange::~TickExchange() {
+    for (MPI_Request &request : requests) {
+        if (request != MPI_REQUEST_NULL) {
+            MPI_Request_free(&request);
+        }
+    }
+
+    for (MPI_Datatype &type : message_types) {
+        MPI_Type_free(&type);
+    }
+
+    if (neighbor_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&neighbor_comm);
+    }
+
+    if (inbox_win != MPI_WIN_NULL) {
+        MPI_Win_free(&inbox_win);
+        MPI_Group_free(&send_group);
+        MPI_Group_free(&receive_group);
+    }
+}
+
+// The persistent requests point into the buffers, which keep their
+// memory when swapped
+void TickExchange::swap(TickExchange &other) {
+    std::swap(mode, other.mode);
+    std::swap(neighbor_comm, other.neighbor_comm);
+    std::swap(inbox_win, other.inbox_win);
+    std::swap(inbox, other.inbox);
+    inbox_offsets.swap(other.inbox_offsets);
+    target_offsets.swap(other.target_offsets);
+    std::swap(send_group, other.send_group);
+    std::swap(receive_group, other.receive_group);
+    send_ranks.swap(other.send_ranks);
+    send_index.swap(other.send_index);
+    send_capacity.swap(other.send_capacity);
+    send_offsets.swap(other.send_offsets);
+    send_counts.swap(other.send_counts);
+    send_buffer.swap(other.send_buffer);
+    receive_ranks.swap(other.receive_ranks);
+    receive_capacity.swap(other.receive_capacity);
+    receive_offsets.swap(other.receive_offsets);
+    receive_buffer.swap(other.receive_buffer);
+    receive_counts.swap(other.receive_counts);
+    send_headers.swap(other.send_headers);
+    receive_headers.swap(other.receive_headers);
+    message_types.swap(other.message_types);
+    requests.swap(other.requests);
+    interior_links.swap(other.interior_links);
+    boundary_links.swap(other.boundary_links);
+    receive_links.swap(other.receive_links);
+    num_inputs.swap(other.num_inputs);
+    missing_inputs.swap(other.missing_inputs);
+    std::swap(num_received, other.num_received);
+    std::swap(receiving, other.receiving);
+}
+
+void TickExchange::add(const Troon &troon, const Partition &partition) {
+    int i = send_index[partition.link_rank(troon.on_link)];
+    assert(send_counts[i] < send_capacity[i]);
+
+    send_buffer[send_offsets[i] + send_counts[i]++] = troon;
+}
+
+void TickExchange::start() {
+    missing_inputs = num_inputs;
+    num_received = 0;
+    receiving = true;
+
+    if (mode == Options::Exchange::neighbor) {
+        // Collectives need matching counts, so the counts go first
+        MPI_Ineighbor_alltoall(send_counts.data(), 1, MPI_INT,
+                               receive_counts.data(), 1, MPI_INT,
+                               neighbor_comm, &requests[0]);
+    } else if (mode == Options::Exchange::rma) {
+        // One post-start-complete-wait epoch per tick: our inbox is exposed
+        // to the receive ranks while we put into the inboxes of the send
+        // ranks
+        MPI_Win_post(receive_group, 0, inbox_win);
+        MPI_Win_start(send_group, 0, inbox_win);
+
+        for (size_t i = 0; i < send_ranks.size(); i++) {
+            send_headers[i] = send_counts[i];
+            MPI_Put(&send_headers[i], 1, MPI_UNSIGNED, send_ranks[i],
+                    target_offsets[i], 1, MPI_UNSIGNED, inbox_win);
+
+            if (send_counts[i]) {
+                MPI_Put(send_buffer.data() + send_offsets[i], send_counts[i],
+                        Troon::datatype, send_ranks[i],
+                        target_offsets[i] + sizeof(uint32_t), send_counts[i],
+                        Troon::datatype, inbox_win);
+            }
+        }
+
+        MPI_Win_complete(inbox_win);
+    } else if (!requests.empty()) {
+        for (size_t i = 0; i < send_ranks.size(); i++) {
+            send_headers[i] = send_counts[i];
+        }
+
+        MPI_Startall(requests.size(), requests.data());
+    }
+}
+
+bool TickExchange::receive_some(std::vector<Troon> &arrivals,
+                                std::vector<uint32_t> &ready_links) {
+    size_t num_receive = receive_ranks.size();
+
+    arrivals.clear();
+    ready_links.clear();
+
+    if (!receiving) {
+        return false;
+    }
+
+    // The collective and one-sided exchanges complete all ranks at once
+    if (mode != Options::Exchange::p2p) {
+        if (mode == Options::Exchange::neighbor) {
+            finish_neighbor(arrivals);
+        } else {
+            finish_rma(arrivals);
+        }
+
+        finish_sends();
+        receiving = false;
+        ready_links = boundary_links;
+        return true;
+    }
+
+    if (num_received == num_receive) {
+        finish_sends();
+        receiving = false;
+        return false;
+    }
+
+    std::vector<int> indices(num_receive);
+    int count;
+    MPI_Waitsome(num_receive, requests.data(), &count, indices.data(),
+                 MPI_STATUSES_IGNORE);
+
+    for (int j = 0; j < count; j++) {
+        int i = indices[j];
+
+        const Troon *troons = receive_buffer.data() + receive_offsets[i];
+        uint32_t num_troons = receive_headers[i];
+        assert(num_troons <= static_cast<uint32_t>(receive_capacity[i]));
+
+        arrivals.insert(arrivals.end(), troons, troons + num_troons);
+
+        for (uint32_t link_index : receive_links[i]) {
+            if (!--missing_inputs[link_index]) {
+                ready_links.push_back(boundary_links[link_index]);
+            }
+        }
+    }
+
+    num_received += count;
+    return true;
+}
+
+void TickExchange::finish_sends() {
+    if (mode == Options::Exchange::p2p) {
+        size_t num_receive = receive_ranks.size();
+        MPI_Waitall(send_ranks.size(), requests.data() + num_receive,
+                    MPI_STATUSES_IGNORE);
+    }
+
+    std::fill(send_counts.begin(), send_counts.end(), 0);
+}
+
+void TickExchange::finish_neighbor(std::vector<Troon> &arrivals) {
+    size_t num_receive = receive_ranks.size();
+    MPI_Wait(&requests[0], MPI_STATUS_IGNORE);
+
+    std::vector<int> arrival_offsets(num_receive);
+    int total_count = 0;
+    for (size_t i = 0; i < num_receive; i++) {
+        arrival_offsets[i] = total_count;
+        total_count += receive_counts[i];
+    }
+
+    arrivals.resize(total_count);
+    MPI_Neighbor_alltoallv(send_buffer.data(), send_counts.data(),
+                           send_offsets.data(), Troon::datatype,
+                           arrivals.data(), receive_counts.data(),
+                           arrival_offsets.data(), Troon::datatype,
+                           neighbor_comm);
+}
+
+void TickExchange::finish_rma(std::vector<Troon> &arrivals) {
+    MPI_Win_wait(inbox_win);
+
+    arrivals.clear();
+    for (size_t i = 0; i < receive_ranks.size(); i++) {
+        const char *block = inbox + inbox_offsets[i];
+
+        uint32_t count;
+        memcpy(&count, block, sizeof(count));
+        assert(count <= static_cast<uint32_t>(receive_capacity[i]));
+
+        const Troon *troons =
+            reinterpret_cast<const Troon *>(block + sizeof(count));
+        arrivals.insert(arrivals.end(), troons, troons + count);
+    }
+}
+
+// Updates the platforms of the links, the links are independent here
+void update_platforms(LinkGroup &link_group,
+                      const std::vector<uint32_t> &link_ids, uint32_t tick,
+                      int num_threads) {
+    size_t count = link_ids.size();
+
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1) \
+    schedule(static)
+    for (size_t i = 0; i < count; i++) {
+        link_group.update_platform(link_ids[i], tick);
+    }
+}
+
+void simulate_tick(Network &network, LinkGroup &link_group,
+                   const Partition &partition, TickExchange &exchange,
+                   uint32_t tick, int num_threads) {
+    double start_time = MPI_Wtime();
+
+    spawn_troons(network, link_group, tick);
+
+    // Troons finishing their transit. A link only changes itself and its
+    // own troons here, the troons moving to other links are collected per
+    // thread and handed over afterwards. The waiting areas order troons
+    // by time and id, so the order of the handovers does not matter
+    struct Handoffs {
+        std::vector<uint32_t> local;
+        std::vector<uint32_t> remote;
+    };
+    std::vector<Handoffs> handoffs(num_threads);
+
+    uint32_t start = link_group.start;
+    uint32_t end = link_group.end;
+
+#pragma omp parallel for num_threads(num_threads) if (num_threads > 1) \
+    schedule(static)
+    for (uint32_t link_id = start; link_id < end; link_id++) {
+        if (!link_group.transit_done(link_id, tick)) {
+            continue;
+        }
+
+        const Troon *transit_troon = link_group.get_troon(
+            link_group.link_states.in_transit[link_id - start]);
+        uint32_t dst_link_id =
+            network.links[link_id - 1].next_link[transit_troon->line];
+        uint32_t troon_index =
+            link_group.finish_transit(link_id, dst_link_id, tick);
+
+        Handoffs &thread_handoffs = handoffs[omp_get_thread_num()];
+        if (link_group.has_link(dst_link_id)) {
+            thread_handoffs.local.push_back(troon_index);
+        } else {
+            thread_handoffs.remote.push_back(troon_index);
+        }
+    }
+
+    for (const Handoffs &thread_handoffs : handoffs) {
+        // Next link is in same group, just transfer directly
+        for (uint32_t troon_index : thread_handoffs.local) {
+            link_group.enqueue(troon_index);
+        }
+
+        // Next link is not in the same group, send it to the rank that
+        // owns the link and free its slot
+        for (uint32_t troon_index : thread_handoffs.remote) {
+            exchange.add(*link_group.get_troon(troon_index), partition);
+            link_group.remove_troon(troon_index);
+        }
+    }
+
+    exchange.start();
+
+    // Links that can not get troons from other ranks do not have to wait
+    // for the exchange
+    update_platforms(link_group, exchange.interior_links, tick, num_threads);
+
+    link_group.compute_time += MPI_Wtime() - start_time;
+
+    // Boundary links are updated as soon as all the ranks they get troons
+    // from are received
+    std::vector<Troon> arrivals;
+    std::vector<uint32_t> ready_links;
+    while (exchange.receive_some(arrivals, ready_links)) {
+        start_time = MPI_Wtime();
+
+        // Add arriving troons to waiting platform
+        for (const Troon &arriving_troon : arrivals) {
+            link_group.add_troon(arriving_troon);
+        }
+
+        update_platforms(link_group, ready_links, tick, num_threads);
+
+        link_group.compute_time += MPI_Wtime() - start_time;
+    }
+}
+
+// Earliest tick after tick in which one of the links can change. Earlier
+// than the actual next change is fine, later would skip it
+uint32_t next_event_tick(const Network &network, LinkGroup &link_group,
+                         uint32_t tick) {
+    for (size_t line = 0; line < num_lines; line++) {
+        if (network.num_line_troons_spawned[line] <
+            network.num_line_troons_total[line]) {
+            return tick + 1;
+        }
+    }
+
+    uint32_t next = std::numeric_limits<uint32_t>::max();
+    const LinkStates &links = link_group.link_states;
+    for (uint32_t i = 0; i < link_group.count(); i++) {
+        next = std::min(next, links.transit_end[i]);
+
+        if (links.on_platform[i]) {
+            if (links.platform_state[i] == Troon::State::waiting_transit) {
+                return tick + 1;
+            }
+
+            // Leaving while the link is busy waits for the transit, which
+            // is an event of its own
+            if (!links.in_transit[i]) {
+                next = std::min(next, links.platform_timestamp[i] +
+                                          links.popularity[i] + 1);
+            }
+        } else if (!links.waiting_platform[i].empty()) {
+            return tick + 1;
+        }
+    }
+
+    return std::max(next, tick + 1);
+}
+
+// Tick to simulate after tick. In the event driven mode the ranks agree on
+// the earliest next event and skip to it, the printed ticks are always
+// simulated
+uint32_t next_tick(const Network &network, LinkGroup &link_group,
+                   const Options &options, uint32_t tick) {
+    if (!options.event_driven ||
+        network.ticks - network.num_print_lines <= tick + 1) {
+        return tick + 1;
+    }
+
+    uint32_t next = next_event_tick(network, link_group, tick);
+    MPI_Allreduce(MPI_IN_PLACE, &next, 1, MPI_UNSIGNED, MPI_MIN,
+                  MPI_COMM_WORLD);
+
+    return std::min(next, network.ticks - network.num_print_lines);
+}
+
+// Detects when the troons come back to an earlier state once all troons
+// are spawned, with Brent's algorithm. How a troon moves on only depends
+// on the time since its state_timestamp, so two states with the same
+// troons at the same places for the same times repeat with the period
+// between them. States are compared by a hash first and then exactly,
+// each rank compares its own troons and the ranks agree with a reduction
+struct CycleDetector {
+    struct TroonState {
+        uint32_t id;
+        uint32_t line;
+        Troon::State state;
+        uint32_t age;
+        uint32_t on_link;
+
+        bool operator==(const TroonState &other) const;
+        bool operator<(const TroonState &other) const;
+    };
+
+    std::vector<TroonState> saved;
+    uint64_t saved_hash;
+    uint32_t saved_tick;
+    uint32_t power;
+    bool started;
+    bool done;
+
+    CycleDetector();
+
+    // Moves the troons ahead by whole periods once the state after tick
+    // repeats, as close to until_tick as possible. Returns the tick the
+    // troons are at now. Collective
+    uint32_t fast_forward(const Network &network, LinkGroup &link_group,
+                          uint32_t tick, uint32_t until_tick);
+
+   private:
+    static uint64_t state_hash(const std::vector<TroonState> &states);
+};
+
+bool CycleDetector::TroonState::operator==(const TroonState &other) const {
+    return id == other.id && line == other.line && state == other.state &&
+           age == other.age && on_link == other.on_link;
+}
+
+bool CycleDetector::TroonState::operator<(const TroonState &other) const {
+    if (line != other.line) {
+        return line < other.line;
+    }
+
+    return id < other.id;
+}
+
+CycleDetector::CycleDetector()
+    : saved_hash(0), saved_tick(0), power(1), started(false), done(false) {}
+
+// Independent of the order of the troons
+uint64_t CycleDetector::state_hash(const std::vector<TroonState> &states) {
+    uint64_t hash = 0;
+    for (const TroonState &troon : states) {
+        uint64_t x = (uint64_t(troon.id) << 32 | troon.on_link) ^
+                     (uint64_t(troon.age) << 40 ^ uint64_t(troon.line) << 8 ^
+                      static_cast<uint64_t>(troon.state));
+
+        // splitmix64 finalizer
+        x += 0x9e3779b97f4a7c15;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        hash += x ^ (x >> 31);
+    }
+
+    return hash;
+}
+
+uint32_t CycleDetector::fast_forward(const Network &network,
+                                     LinkGroup &link_group, uint32_t tick,
+                                     uint32_t until_tick) {
+    if (done) {
+        return tick;
+    }
+
+    for (size_t line = 0; line < num_lines; line++) {
+        if (network.num_line_troons_spawned[line] <
+            network.num_line_troons_total[line]) {
+            return tick;
+        }
+    }
+
+    if (tick + 1 >= until_tick) {
+        done = true;
+        return tick;
+    }
+
+    std::vector<TroonState> states;
+    for (const Troon &troon : link_group.troons) {
+        if (troon.on_link) {
+            states.push_back({troon.id, troon.line, troon.state,
+                              tick - troon.state_timestamp, troon.on_link});
+        }
+    }
+    uint64_t hash = state_hash(states);
+
+    int repeated = 0;
+    if (started && hash == saved_hash) {
+        std::sort(states.begin(), states.end());
+        repeated = states == saved;
+    }
 
-    std::cout << "\nStations: ";
-    for (size_t i = 0; i < num_stations; i++) {
-        std::cout << station_names[i] << " (" << stations[i].popularity << ")";
+    MPI_Allreduce(MPI_IN_PLACE, &repeated, 1, MPI_INT, MPI_MIN,
+                  MPI_COMM_WORLD);
 
-        if (i != num_stations - 1) {
-            std::cout << ", ";
+    if (!repeated) {
+        // Brent: keep the state at powers of two ticks since the last
+        // saved state
+        if (!started || tick - saved_tick >= power) {
+            if (started) {
+                power *= 2;
+            }
+
+            std::sort(states.begin(), states.end());
+            saved = std::move(states);
+            saved_hash = hash;
+            saved_tick = tick;
+            started = true;
         }
+
+        return tick;
     }
-    std::cout << "\n\n";
 
-    const char *line_names[num_lines] = {"Green", "Yellow", "Blue"};
-    for (size_t line = 0; line < num_lines; line++) {
-        std::cout << line_names[line] << " line: ";
+    done = true;
+    saved.clear();
 
-        const Link *link = &links[line_forward_start[line] - 1];
-        std::cout << station_names[link->src];
+    uint32_t period = tick - saved_tick;
+    uint32_t skipped = (until_tick - 1 - tick) / period * period;
 
-        uint32_t next_link_id;
-        do {
-            std::cout << " -> " << station_names[link->dst];
+    link_group.shift(skipped);
 
-            next_link_id = link->next_link[line];
-            link = &links[next_link_id - 1];
-        } while (next_link_id != line_forward_start[line]);
+    return tick + skipped;
+}
 
-        std::cout << '\n';
+// Moves links between ranks when the compute time of the ranks since the
+// last call is out of balance. The time of a rank is split over its links
+// by the troons on them, the new bounds balance that cost and the links
+// that change owner are sent over with their troons. Returns whether the
+// partition changed
+bool rebalance(const Network &network, LinkGroup &link_group,
+               Partition &partition, int rank, int num_proc) {
+    constexpr double max_imbalance = 1.1;
+
+    std::vector<double> rank_times(num_proc);
+    MPI_Allgather(&link_group.compute_time, 1, MPI_DOUBLE, rank_times.data(),
+                  1, MPI_DOUBLE, MPI_COMM_WORLD);
+    link_group.compute_time = 0;
+
+    double max_time = 0;
+    double total_time = 0;
+    for (double time : rank_times) {
+        max_time = std::max(max_time, time);
+        total_time += time;
+    }
+
+    if (max_time <= max_imbalance * total_time / num_proc) {
+        return false;
+    }
+
+    std::vector<double> troons_on_link(link_group.count(), 1.0);
+    for (const Troon &troon : link_group.troons) {
+        if (troon.on_link) {
+            troons_on_link[troon.on_link - link_group.start]++;
+        }
+    }
+
+    double rank_weight = 0;
+    for (double weight : troons_on_link) {
+        rank_weight += weight;
     }
+
+    std::vector<double> my_cost(link_group.count());
+    for (size_t i = 0; i < my_cost.size(); i++) {
+        my_cost[i] = rank_times[rank] * troons_on_link[i] / rank_weight;
+    }
+
+    std::vector<int> link_counts(num_proc);
+    std::vector<int> link_offsets(num_proc);
+    for (int r = 0; r < num_proc; r++) {
+        link_counts[r] = partition.bounds[r + 1] - partition.bounds[r];
+        link_offsets[r] = partition.bounds[r] - 1;
+    }
+
+    std::vector<double> link_cost(partition.bounds[num_proc] - 1);
+    MPI_Allgatherv(my_cost.data(), my_cost.size(), MPI_DOUBLE,
+                   link_cost.data(), link_counts.data(), link_offsets.data(),
+                   MPI_DOUBLE, MPI_COMM_WORLD);
+
+    // Every rank has the same costs, so they all agree on the new bounds
+    if (!partition.rebalance(link_cost)) {
+        return false;
+    }
+
+    std::vector<Troon> kept;
+    std::vector<std::vector<Troon>> outgoing(num_proc);
+    for (const Troon &troon : link_group.troons) {
+        if (!troon.on_link) {
+            continue;
+        }
+
+        int owner = partition.link_rank(troon.on_link);
+        if (owner == rank) {
+            kept.push_back(troon);
+        } else {
+            outgoing[owner].push_back(troon);
+        }
+    }
+
+    std::vector<int> send_counts(num_proc);
+    std::vector<int> send_offsets(num_proc);
+    std::vector<Troon> send_buffer;
+    for (int r = 0; r < num_proc; r++) {
+        send_counts[r] = outgoing[r].size();
+        send_offsets[r] = send_buffer.size();
+        send_buffer.insert(send_buffer.end(), outgoing[r].begin(),
+                           outgoing[r].end());
+    }
+
+    std::vector<int> receive_counts(num_proc);
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, receive_counts.data(), 1,
+                 MPI_INT, MPI_COMM_WORLD);
+
+    std::vector<int> receive_offsets(num_proc);
+    for (int r = 1; r < num_proc; r++) {
+        receive_offsets[r] = receive_offsets[r - 1] + receive_counts[r - 1];
+    }
+
+    size_t num_kept = kept.size();
+    kept.resize(num_kept + receive_offsets[num_proc - 1] +
+                receive_counts[num_proc - 1]);
+    MPI_Alltoallv(send_buffer.data(), send_counts.data(), send_offsets.data(),
+                  Troon::datatype, kept.data() + num_kept,
+                  receive_counts.data(), receive_offsets.data(),
+                  Troon::datatype, MPI_COMM_WORLD);
+
+    link_group.reset(network, partition, rank, std::move(kept));
+    return true;
 }
 
-void Network::broadcast() {
-    const int num_vals = 13;
-    uint32_t vals[num_vals];
+std::string troon_name(const Troon &troon) {
+    char prefix[3] = {'g', 'y', 'b'};
+    return std::string(1, prefix[troon.line]) + std::to_string(troon.id);
+}
 
-    vals[0] = stations.size();
-    vals[1] = links.size();
+void print_troons(std::vector<Troon> &troons, const Network &network,
+                  uint32_t tick) {
+    std::sort(troons.begin(), troons.end(),
+              [](const Troon &a, const Troon &b) {
+                  return troon_name(a) < troon_name(b);
+              });
 
-    vals[2] = line_forward_start[0];
-    vals[3] = line_forward_start[1];
-    vals[4] = line_forward_start[2];
+    std::cout << tick << ": ";
+    for (const auto &troon : troons) {
+        if (!troon.on_link) {
+            // Skip invalid troon
+            continue;
+        }
 
-    vals[5] = line_backward_start[0];
-    vals[6] = line_backward_start[1];
-    vals[7] = line_backward_start[2];
+        std::cout << troon_name(troon);
+
+        uint32_t src = network.links[troon.on_link - 1].src;
+        std::cout << "-" << network.station_names[src];
+
+        if (troon.state == Troon::State::in_transit) {
+            uint32_t dst = network.links[troon.on_link - 1].dst;
+            std::cout << "->" << network.station_names[dst];
+        } else if (troon.state == Troon::State::waiting_platform) {
+            std::cout << "#";
+        } else {
+            std::cout << "%";
+        }
+
+        std::cout << " ";
+    }
+
+    std::cout << '\n'
+              << std::flush;
+}
+
+// Conservative parallel discrete event simulation in the style of
+// Chandy-Misra. A troon entering a link towards another rank is sent right
+// away with its arrival tick, and every rank tells the ranks it sends to
+// the tick before which it can no longer send an arrival. A rank simulates
+// every tick that all its incoming channels have passed, so it can run
+// several ticks ahead of its neighbours
+struct LookaheadExchange {
+    static constexpr int tag = 1;
+    static constexpr uint32_t no_bound = std::numeric_limits<uint32_t>::max();
+
+    struct Channel {
+        int rank;
+
+        // Outgoing: our links with a next link on the rank. Incoming:
+        // arrivals before the bound have all been received
+        std::vector<uint32_t> links;
+        uint32_t bound;
+        std::vector<Troon> arrivals;
+    };
+
+    struct CompareArrival {
+        bool operator()(const Troon &a, const Troon &b) const {
+            return a.state_timestamp > b.state_timestamp;
+        }
+    };
+
+    std::vector<Channel> outgoing;
+    std::vector<Channel> incoming;
+    std::vector<int> outgoing_index;
+
+    // Received arrivals by arrival tick
+    std::priority_queue<Troon, std::vector<Troon>, CompareArrival> arrivals;
+
+    std::vector<std::vector<char>> send_buffers;
+    std::vector<MPI_Request> send_requests;
+
+    LookaheadExchange(const Network &network, const Partition &partition,
+                      const LinkGroup &link_group, int rank, int num_proc);
+
+    void send_arrival(const Troon &troon, uint32_t arrival_tick,
+                      uint32_t dst_link, const Partition &partition);
+    void deliver_arrivals(LinkGroup &link_group, uint32_t tick);
+
+    // Sends the arrivals and bounds of the ticks before next_tick
+    void send(const Network &network, LinkGroup &link_group,
+              uint32_t next_tick);
+    bool receive(bool block);
+
+    // First tick that can not be simulated yet
+    uint32_t horizon() const;
+
+    void finish();
+};
+
+LookaheadExchange::LookaheadExchange(const Network &network,
+                                     const Partition &partition,
+                                     const LinkGroup &link_group, int rank,
+                                     int num_proc)
+    : outgoing_index(num_proc, -1) {
+    std::vector<int> incoming_index(num_proc, -1);
+
+    for (uint32_t link_id = link_group.start; link_id < link_group.end;
+         link_id++) {
+        const Link &link = network.links[link_id - 1];
+
+        for (size_t line = 0; line < num_lines; line++) {
+            if (link.next_link[line]) {
+                int dst_rank = partition.link_rank(link.next_link[line]);
+                if (dst_rank != rank) {
+                    if (outgoing_index[dst_rank] < 0) {
+                        outgoing_index[dst_rank] = outgoing.size();
+                        outgoing.push_back({dst_rank, {}, 0, {}});
+                    }
+
+                    std::vector<uint32_t> &links =
+                        outgoing[outgoing_index[dst_rank]].links;
+                    if (links.empty() || links.back() != link_id) {
+                        links.push_back(link_id);
+                    }
+                }
+            }
+
+            if (link.prev_link[line]) {
+                int src_rank = partition.link_rank(link.prev_link[line]);
+                if (src_rank != rank && incoming_index[src_rank] < 0) {
+                    incoming_index[src_rank] = incoming.size();
+                    incoming.push_back({src_rank, {}, 0, {}});
+                }
+            }
+        }
+    }
+}
+
+void LookaheadExchange::send_arrival(const Troon &troon,
+                                     uint32_t arrival_tick, uint32_t dst_link,
+                                     const Partition &partition) {
+    Troon arrival = troon;
+    arrival.state = Troon::State::waiting_platform;
+    arrival.state_timestamp = arrival_tick;
+    arrival.on_link = dst_link;
+
+    int dst_rank = partition.link_rank(dst_link);
+    outgoing[outgoing_index[dst_rank]].arrivals.push_back(arrival);
+}
+
+void LookaheadExchange::deliver_arrivals(LinkGroup &link_group,
+                                         uint32_t tick) {
+    while (!arrivals.empty() && arrivals.top().state_timestamp == tick) {
+        link_group.add_troon(arrivals.top());
+        arrivals.pop();
+    }
+
+    assert(arrivals.empty() || arrivals.top().state_timestamp > tick);
+}
+
+// Earliest tick a troon can arrive at the next links, when the ticks
+// before next_tick are simulated. Troons already in transit were sent when
+// they entered the link, and any other troon has to finish at the platform
+// first
+uint32_t earliest_arrival(const LinkGroup &link_group, uint32_t link_id,
+                          uint32_t next_tick) {
+    const LinkStates &links = link_group.link_states;
+    uint32_t i = link_group.link_index(link_id);
+
+    uint32_t transit_tick;
+    if (!links.on_platform[i]) {
+        // Boards at next_tick at the earliest
+        transit_tick = next_tick + links.popularity[i] + 2;
+    } else if (links.platform_state[i] == Troon::State::waiting_transit) {
+        transit_tick = next_tick;
+    } else {
+        transit_tick = std::max(next_tick, links.platform_timestamp[i] +
+                                               links.popularity[i] + 1) + 1;
+    }
+
+    return transit_tick + std::max(links.length[i], 1u);
+}
+
+void LookaheadExchange::send(const Network &network, LinkGroup &link_group,
+                             uint32_t next_tick) {
+    for (Channel &channel : outgoing) {
+        uint32_t bound = no_bound;
+        if (next_tick < network.ticks) {
+            for (uint32_t link_id : channel.links) {
+                bound = std::min(bound, earliest_arrival(link_group, link_id,
+                                                         next_tick));
+            }
+        }
+
+        // Both bounds hold, the new one is not always the larger
+        bound = std::max(bound, channel.bound);
+        if (bound == channel.bound && channel.arrivals.empty()) {
+            continue;
+        }
+        channel.bound = bound;
+
+        int header_size, troons_size;
+        MPI_Pack_size(2, MPI_UNSIGNED, MPI_COMM_WORLD, &header_size);
+        MPI_Pack_size(channel.arrivals.size(), Troon::datatype,
+                      MPI_COMM_WORLD, &troons_size);
+
+        std::vector<char> buffer(header_size + troons_size);
+        int position = 0;
+
+        uint32_t header[2] = {bound,
+                              static_cast<uint32_t>(channel.arrivals.size())};
+        MPI_Pack(header, 2, MPI_UNSIGNED, buffer.data(), buffer.size(),
+                 &position, MPI_COMM_WORLD);
+        MPI_Pack(channel.arrivals.data(), channel.arrivals.size(),
+                 Troon::datatype, buffer.data(), buffer.size(), &position,
+                 MPI_COMM_WORLD);
+        channel.arrivals.clear();
+
+        send_buffers.push_back(std::move(buffer));
+        send_requests.emplace_back();
+        MPI_Isend(send_buffers.back().data(), position, MPI_PACKED,
+                  channel.rank, tag, MPI_COMM_WORLD, &send_requests.back());
+    }
+
+    // Release the buffers once all of their sends are done
+    int done;
+    MPI_Testall(send_requests.size(), send_requests.data(), &done,
+                MPI_STATUSES_IGNORE);
+    if (done) {
+        send_buffers.clear();
+        send_requests.clear();
+    }
+}
+
+// Receives one message, returns false if none was available without
+// blocking
+bool LookaheadExchange::receive(bool block) {
+    MPI_Status status;
+    if (block) {
+        MPI_Probe(MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &status);
+    } else {
+        int available;
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &available, &status);
+        if (!available) {
+            return false;
+        }
+    }
+
+    int size;
+    MPI_Get_count(&status, MPI_PACKED, &size);
+
+    std::vector<char> buffer(size);
+    MPI_Recv(buffer.data(), size, MPI_PACKED, status.MPI_SOURCE, tag,
+             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+    int position = 0;
+    uint32_t header[2];
+    MPI_Unpack(buffer.data(), size, &position, header, 2, MPI_UNSIGNED,
+               MPI_COMM_WORLD);
+
+    std::vector<Troon> received(header[1]);
+    MPI_Unpack(buffer.data(), size, &position, received.data(), header[1],
+               Troon::datatype, MPI_COMM_WORLD);
+
+    for (const Troon &troon : received) {
+        arrivals.push(troon);
+    }
+
+    for (Channel &channel : incoming) {
+        if (channel.rank == status.MPI_SOURCE) {
+            channel.bound = header[0];
+        }
+    }
+
+    return true;
+}
+
+uint32_t LookaheadExchange::horizon() const {
+    uint32_t horizon = no_bound;
+    for (const Channel &channel : incoming) {
+        horizon = std::min(horizon, channel.bound);
+    }
+
+    return horizon;
+}
+
+// Waits for the last messages of the incoming channels and for our own
+// sends to complete
+void LookaheadExchange::finish() {
+    while (horizon() != no_bound) {
+        receive(true);
+    }
+
+    MPI_Waitall(send_requests.size(), send_requests.data(),
+                MPI_STATUSES_IGNORE);
+    send_buffers.clear();
+    send_requests.clear();
+}
+
+void simulate_lookahead_tick(Network &network, LinkGroup &link_group,
+                             const Partition &partition,
+                             LookaheadExchange &exchange, uint32_t tick) {
+    spawn_troons(network, link_group, tick);
+
+    for (uint32_t link_id = link_group.start; link_id < link_group.end;
+         link_id++) {
+        if (!link_group.transit_done(link_id, tick)) {
+            continue;
+        }
+
+        const Troon *transit_troon = link_group.get_troon(
+            link_group.link_states.in_transit[link_id - link_group.start]);
+        uint32_t dst_link_id =
+            network.links[link_id - 1].next_link[transit_troon->line];
+        uint32_t troon_index =
+            link_group.finish_transit(link_id, dst_link_id, tick);
+
+        if (link_group.has_link(dst_link_id)) {
+            link_group.enqueue(troon_index);
+        } else {
+            // Already sent when it entered the link, it is in the waiting
+            // area of the other rank from this tick on
+            link_group.remove_troon(troon_index);
+        }
+    }
+
+    exchange.deliver_arrivals(link_group, tick);
+
+    for (uint32_t link_id = link_group.start; link_id < link_group.end;
+         link_id++) {
+        uint32_t i = link_group.link_index(link_id);
+        uint32_t in_transit = link_group.link_states.in_transit[i];
+
+        link_group.update_platform(link_id, tick);
+
+        uint32_t entered = link_group.link_states.in_transit[i];
+        if (entered && entered != in_transit) {
+            const Link &link = network.links[link_id - 1];
+            const Troon *troon = link_group.get_troon(entered);
+
+            uint32_t dst_link_id = link.next_link[troon->line];
+            if (!link_group.has_link(dst_link_id)) {
+                exchange.send_arrival(*troon,
+                                      tick + std::max(link.length, 1u),
+                                      dst_link_id, partition);
+            }
+        }
+    }
+}
+
+// Runs the whole simulation with the lookahead exchange. The troons of the
+// printed ticks are kept and gathered once at the end
+void simulate_lookahead(Network &network, LinkGroup &link_group,
+                        const Partition &partition, int rank, int num_proc) {
+    LookaheadExchange exchange(network, partition, link_group, rank,
+                               num_proc);
+
+    uint32_t first_print_tick = network.ticks - network.num_print_lines;
+    std::vector<std::vector<Troon>> printed(network.num_print_lines);
+
+    uint32_t next_tick = 0;
+    exchange.send(network, link_group, next_tick);
+
+    while (next_tick < network.ticks) {
+        while (exchange.receive(false)) {
+        }
+
+        uint32_t horizon = std::min(exchange.horizon(), network.ticks);
+        if (horizon <= next_tick) {
+            exchange.receive(true);
+            continue;
+        }
+
+        for (; next_tick < horizon; next_tick++) {
+            simulate_lookahead_tick(network, link_group, partition, exchange,
+                                    next_tick);
+
+            if (first_print_tick <= next_tick) {
+                std::vector<Troon> &troons =
+                    printed[next_tick - first_print_tick];
+                for (const Troon &troon : link_group.troons) {
+                    if (troon.on_link) {
+                        troons.push_back(troon);
+                    }
+                }
+            }
+        }
+
+        exchange.send(network, link_group, next_tick);
+    }
+
+    exchange.finish();
+
+    std::vector<Troon> all_troons;
+    for (uint32_t i = 0; i < network.num_print_lines; i++) {
+        if (!rank) {
+            gather_all_troons(printed[i], num_proc, all_troons);
+            print_troons(all_troons, network, first_print_tick + i);
+        } else {
+            send_all_troons(printed[i]);
+        }
+    }
+}
+
+// Parses the text input format. Without the matrix, the reader only holds
+// the input before and after it and the link lengths are left at 0
+Network read_text_network(InputReader &reader, bool has_matrix) {
+    std::vector<std::string_view> station_names;
+    uint32_t num_stations;
+    uint32_t ticks;
+    uint32_t num_green;
+    uint32_t num_yellow;
+    uint32_t num_blue;
+    uint32_t num_print_lines;
+
+    num_stations = reader.read_uint();
+
+    // Names are interned once, the views point into the input
+    std::unordered_map<std::string_view, uint32_t> station_ids;
+    station_ids.reserve(num_stations);
+    station_names.reserve(num_stations);
+    for (uint32_t i = 0; i < num_stations; i++) {
+        std::string_view name = reader.read_word();
+        station_ids.emplace(name, i);
+        station_names.emplace_back(name);
+    }
+
+    std::vector<uint32_t> popularities;
+    popularities.reserve(num_stations);
+    for (size_t i = 0; i < num_stations; i++) {
+        popularities.emplace_back(reader.read_uint());
+    }
+
+    // Skip the adjacency matrix for now, the lines need to be known before
+    // we know which of its entries to keep
+    const char *matrix_begin = reader.pos;
+    if (has_matrix) {
+        uint64_t num_entries = uint64_t(num_stations) * num_stations;
+        for (uint64_t i = 0; i < num_entries; i++) {
+            reader.skip_uint();
+        }
+    }
+
+    // The line definitions start on the line after the last number
+    reader.skip_line();
+
+    std::vector<uint32_t> green_stations =
+        resolve_station_names(reader.read_line(), station_ids);
+    std::vector<uint32_t> yellow_stations =
+        resolve_station_names(reader.read_line(), station_ids);
+    std::vector<uint32_t> blue_stations =
+        resolve_station_names(reader.read_line(), station_ids);
+
+    ticks = reader.read_uint();
+
+    num_green = reader.read_uint();
+    num_yellow = reader.read_uint();
+    num_blue = reader.read_uint();
+
+    num_print_lines = reader.read_uint();
+
+    Network network(num_stations, popularities, station_names,
+                    green_stations, yellow_stations, blue_stations,
+                    ticks, num_green, num_yellow, num_blue, num_print_lines);
+
+    if (has_matrix) {
+        InputReader matrix_reader(matrix_begin, reader.end);
+        network.read_link_lengths(matrix_reader, 0,
+                                  uint64_t(num_stations) * num_stations);
+    }
+
+    return network;
+}
+
+// Reads either the text input format or a compiled network file
+Network read_network(const char *path) {
+    std::unique_ptr<InputFile> file(new InputFile(path));
+    if (!file->is_open()) {
+        std::cerr << "Failed to open " << path << '\n';
+        std::exit(2);
+    }
 
-    vals[8] = ticks;
-    vals[9] = num_line_troons_total[0];
-    vals[10] = num_line_troons_total[1];
-    vals[11] = num_line_troons_total[2];
-    vals[12] = num_print_lines;
+    if (NetworkFileHeader::matches(*file)) {
+        return Network(std::move(file));
+    }
 
-    MPI_Bcast(&vals, num_vals, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
-    MPI_Bcast(stations.data(), stations.size(), Station::datatype, 0,
-              MPI_COMM_WORLD);
-    MPI_Bcast(links.data(), links.size(), Link::datatype, 0,
-              MPI_COMM_WORLD);
+    InputReader reader(file->data, file->data + file->size);
+    return read_text_network(reader, true);
+}
 
-    char name_buffer[128];
-    for (auto &name : station_names) {
-        size_t name_length = name.size() + 1;
-        memcpy(name_buffer, name.c_str(), name_length);
-        MPI_Bcast(name_buffer, name_length, MPI_CHAR, 0, MPI_COMM_WORLD);
+void free_comms(MPI_Comm &node_comm, MPI_Comm &leader_comm) {
+    MPI_Comm_free(&node_comm);
+    if (leader_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&leader_comm);
     }
 }
 
-void Network::receive() {
-    const int num_vals = 13;
-    uint32_t vals[num_vals];
-    MPI_Bcast(&vals, num_vals, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+// Reads the network collectively, every node ends up with one copy of it
+// shared by its ranks. Every rank parses the entries of the adjacency matrix
+// inside its own byte range of the text input, the root parses the rest
+Network read_network(const char *path, int rank, int num_proc) {
+    Network network;
 
-    uint32_t num_stations = vals[0];
-    uint32_t num_links = vals[1];
+    // The root has the lowest key, so it always leads its node
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                        MPI_INFO_NULL, &node_comm);
 
-    line_forward_start[0] = vals[2];
-    line_forward_start[1] = vals[3];
-    line_forward_start[2] = vals[4];
+    int node_rank;
+    MPI_Comm_rank(node_comm, &node_rank);
 
-    line_backward_start[0] = vals[5];
-    line_backward_start[1] = vals[6];
-    line_backward_start[2] = vals[7];
+    MPI_Comm leader_comm;
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank ? MPI_UNDEFINED : 0, rank,
+                   &leader_comm);
 
-    ticks = vals[8];
-    num_line_troons_total[0] = vals[9];
-    num_line_troons_total[1] = vals[10];
-    num_line_troons_total[2] = vals[11];
-    num_print_lines = vals[12];
+    int is_binary = 0;
+    std::unique_ptr<InputFile> file;
+    if (!rank) {
+        file.reset(new InputFile(path));
+        if (!file->is_open()) {
+            std::cerr << "Failed to open " << path << '\n';
+            std::exit(2);
+        }
 
-    stations.resize(num_stations);
-    links.resize(num_links);
+        is_binary = NetworkFileHeader::matches(*file);
+    }
 
-    MPI_Bcast(stations.data(), stations.size(), Station::datatype, 0,
-              MPI_COMM_WORLD);
-    MPI_Bcast(links.data(), links.size(), Link::datatype, 0,
-              MPI_COMM_WORLD);
+    MPI_Bcast(&is_binary, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-    station_names.reserve(num_stations);
-    char name_buffer[128];
-    for (uint32_t i = 0; i < num_stations; i++) {
-        MPI_Bcast(name_buffer, 128, MPI_CHAR, 0, MPI_COMM_WORLD);
-        station_names.push_back(std::string(name_buffer));
+    MPI_File input;
+    if (MPI_File_open(MPI_COMM_WORLD, path, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                      &input) != MPI_SUCCESS) {
+        std::cerr << "Failed to open " << path << '\n';
+        std::exit(2);
     }
-}
 
-size_t Network::troon_count() const {
-    size_t count = 0;
-    for (size_t line = 0; line < num_lines; line++) {
-        count += num_line_troons_spawned[line];
-    }
+    if (is_binary) {
+        if (!rank) {
+            network = Network(std::move(file));
+        }
 
-    return count;
-}
+        network.read_binary(input, node_comm, leader_comm, rank);
+        MPI_File_close(&input);
 
-const Station *Network::src(uint32_t link_id) const {
-    return stations.data() + links[link_id - 1].src;
-}
+        free_comms(node_comm, leader_comm);
+        return network;
+    }
 
-const Station *Network::dst(uint32_t link_id) const {
-    return stations.data() + links[link_id - 1].dst;
-}
+    file.reset();
 
-void spawn_troons(Network &network, LinkGroup &link_group, uint32_t tick) {
-    for (size_t line = 0; line < num_lines; line++) {
-        size_t spawned_line = network.num_line_troons_spawned[line];
-        size_t line_total = network.num_line_troons_total[line];
-        size_t left_to_spawn = line_total - spawned_line;
+    InputChunk chunk(input, rank, num_proc);
+    MPI_File_close(&input);
 
-        size_t troon_count = network.troon_count();
+    // The root always has the first token, the number of stations
+    uint32_t num_stations = 0;
+    if (!rank) {
+        num_stations = chunk.reader_at(0).read_uint();
+    }
 
-        uint32_t forward_link_id = network.line_forward_start[line];
-        uint32_t backward_link_id = network.line_backward_start[line];
+    MPI_Bcast(&num_stations, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
 
-        if (left_to_spawn > 0 &&
-            link_group.has_link(forward_link_id)) {
-            Troon troon(troon_count, line, tick, forward_link_id);
-            link_group.troons.push_back(troon);
+    // The matrix follows the number of stations, their names and their
+    // popularities
+    uint64_t matrix_begin = 2 * uint64_t(num_stations) + 1;
+    uint64_t matrix_end = matrix_begin + uint64_t(num_stations) * num_stations;
 
-            LinkState *link_state =
-                link_group.get_link_state(forward_link_id);
-            link_state->waiting_platform.push(link_group.troons.size());
+    uint64_t num_tokens = chunk.first_token + chunk.num_tokens;
+    MPI_Allreduce(MPI_IN_PLACE, &num_tokens, 1, MPI_UINT64_T, MPI_MAX,
+                  MPI_COMM_WORLD);
+    if (num_tokens < matrix_end) {
+        if (!rank) {
+            std::cerr << "Input ends inside the adjacency matrix\n";
         }
-        if (left_to_spawn > 1 &&
-            link_group.has_link(backward_link_id)) {
-            Troon troon(troon_count + 1, line, tick, backward_link_id);
-            link_group.troons.push_back(troon);
 
-            LinkState *link_state =
-                link_group.get_link_state(backward_link_id);
-            link_state->waiting_platform.push(link_group.troons.size());
-        }
+        free_comms(node_comm, leader_comm);
+        MPI_Finalize();
+        std::exit(2);
+    }
 
-        network.num_line_troons_spawned[line] =
-            std::min(spawned_line + 2, line_total);
+    // Everything but the matrix is gathered on the root: the input up to
+    // the end of the last popularity, and from the end of the last entry on
+    MPI_Offset cuts[2] = {0, 0};
+    if (chunk.has_token(matrix_begin - 1)) {
+        cuts[0] = chunk.token_end(matrix_begin - 1);
+    }
+    if (chunk.has_token(matrix_end - 1)) {
+        cuts[1] = chunk.token_end(matrix_end - 1);
     }
-}
 
-void send_all_troons(const LinkGroup &link_group) {
-    int my_count = link_group.troons.size();
-    MPI_Gather(&my_count, 1, MPI_INT, NULL, 0, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, cuts, 2, MPI_OFFSET, MPI_MAX,
+                  MPI_COMM_WORLD);
 
-    MPI_Gatherv(link_group.troons.data(), my_count, Troon::datatype, nullptr,
-                nullptr, nullptr, Troon::datatype, 0, MPI_COMM_WORLD);
-}
+    std::string_view head = chunk.bytes(0, cuts[0]);
+    std::string_view tail =
+        chunk.bytes(cuts[1], std::numeric_limits<MPI_Offset>::max());
 
-void gather_all_troons(const LinkGroup &link_group, int num_proc,
-                       std::vector<Troon> &out) {
-    std::vector<int> troon_counts(num_proc);
-    std::vector<int> offsets(num_proc);
+    std::vector<char> rest(head.begin(), head.end());
+    rest.insert(rest.end(), tail.begin(), tail.end());
 
-    int my_count = link_group.troons.size();
-    MPI_Gather(&my_count, 1, MPI_INT, troon_counts.data(), 1, MPI_INT, 0,
+    int rest_size = rest.size();
+    std::vector<int> rest_sizes(num_proc);
+    std::vector<int> rest_offsets(num_proc);
+    MPI_Gather(&rest_size, 1, MPI_INT, rest_sizes.data(), 1, MPI_INT, 0,
                MPI_COMM_WORLD);
 
-    int total_count = troon_counts[0];
-
     for (int i = 1; i < num_proc; i++) {
-        offsets[i] = troon_counts[i - 1] + offsets[i - 1];
-        total_count += troon_counts[i];
+        rest_offsets[i] = rest_offsets[i - 1] + rest_sizes[i - 1];
     }
 
-    out.resize(total_count);
+    std::vector<char> text;
+    if (!rank) {
+        text.resize(rest_offsets[num_proc - 1] + rest_sizes[num_proc - 1]);
+    }
 
-    MPI_Gatherv(link_group.troons.data(), my_count, Troon::datatype, out.data(),
-                troon_counts.data(), offsets.data(), Troon::datatype, 0,
+    MPI_Gatherv(rest.data(), rest_size, MPI_CHAR, text.data(),
+                rest_sizes.data(), rest_offsets.data(), MPI_CHAR, 0,
                 MPI_COMM_WORLD);
-}
 
-void send_troon_message(size_t index, const Network &network, int num_proc,
-                        std::vector<TroonMessage> &msg_buffer,
-                        std::vector<MPI_Request> &request_buffer) {
-    TroonMessage &msg = msg_buffer[index];
-    Troon &troon = msg.troon;
+    if (!rank) {
+        InputReader reader(text.data(), text.data() + text.size());
+        network = read_text_network(reader, false);
+        network.broadcast(node_comm, leader_comm);
+    } else {
+        network.receive(node_comm, leader_comm);
+    }
 
-    MPI_Request &req = request_buffer[index];
+    // Every rank fills in the lengths from its entries straight into the
+    // shared topology, since each link is one entry summing them up across
+    // nodes combines the lengths
+    uint64_t entry_begin = std::max(chunk.first_token, matrix_begin);
+    uint64_t entry_end =
+        std::min(chunk.first_token + chunk.num_tokens, matrix_end);
+
+    if (entry_begin < entry_end) {
+        InputReader reader = chunk.reader_at(entry_begin);
+        network.read_link_lengths(reader, entry_begin - matrix_begin,
+                                  entry_end - entry_begin);
+    }
 
-    int dst_rank = link_rank(msg.dst_link, num_proc, network.links.size());
+    network.sync_shared();
 
-    MPI_Isend(&troon, 1, Troon::datatype, dst_rank, 0,
-              MPI_COMM_WORLD, &req);
-}
+    if (leader_comm != MPI_COMM_NULL) {
+        std::vector<uint32_t> lengths(network.links.size());
+        for (size_t i = 0; i < lengths.size(); i++) {
+            lengths[i] = network.links[i].length;
+        }
 
-void receive_troon_message(size_t index, const Network &network,
-                           int num_proc, std::vector<TroonMessage> &msg_buffer,
-                           std::vector<MPI_Request> &request_buffer) {
-    TroonMessage &msg = msg_buffer[index];
-    Troon &troon = msg.troon;
+        MPI_Allreduce(MPI_IN_PLACE, lengths.data(), lengths.size(),
+                      MPI_UNSIGNED, MPI_SUM, leader_comm);
 
-    MPI_Request &req = request_buffer[index];
+        for (size_t i = 0; i < lengths.size(); i++) {
+            network.links[i].length = lengths[i];
+        }
+    }
 
-    int src_rank = link_rank(msg.src_link, num_proc, network.links.size());
+    network.sync_shared();
 
-    MPI_Irecv(&troon, 1, Troon::datatype, src_rank, 0,
-              MPI_COMM_WORLD, &req);
+    free_comms(node_comm, leader_comm);
+    return network;
 }
 
-void simulate_tick(Network &network, LinkGroup &link_group,
-                   uint32_t tick, int num_proc) {
-    spawn_troons(network, link_group, tick);
+void compile_exec(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cerr << argv[0] << " --compile <input_file> <output_file>\n";
+        std::exit(1);
+    }
 
-    std::vector<TroonMessage> send_messages;
-    std::vector<MPI_Request> send_requests;
+    Network network = read_network(argv[2]);
+    network.write_binary(argv[3]);
+}
 
-    std::vector<TroonMessage> receive_messages;
-    std::vector<MPI_Request> receive_requests;
+// Splits the links into chunks that the threads take from their own range
+// first and then steal from the end of the ranges of the others. A range
+// packs its begin and end into one atomic so taking and stealing the last
+// chunk can not race
+struct ChunkQueues {
+    static constexpr uint32_t chunk_size = 64;
 
-    // Sending and receiving troons
-    for (uint32_t link_id = link_group.start; link_id < link_group.end;
-         link_id++) {
-        Link *link = &network.links[link_id - 1];
-        LinkState *link_state = link_group.get_link_state(link_id);
-
-        uint32_t has_sent[num_lines] = {};
-
-        // Transit troon on link
-        Troon *transit_troon = link_group.get_troon(link_state->in_transit);
-        if (transit_troon &&
-            tick - transit_troon->state_timestamp >= link->length) {
-            uint32_t dst_link_id = link->next_link[transit_troon->line];
-            transit_troon->state = Troon::State::waiting_platform;
-            transit_troon->state_timestamp = tick;
-            transit_troon->on_link = dst_link_id;
-
-            if (link_group.has_link(dst_link_id)) {
-                // Next link is in same group, just transfer directly
-                LinkState *next_link_state =
-                    link_group.get_link_state(dst_link_id);
-
-                next_link_state->waiting_platform.push(link_state->in_transit);
-            } else {
-                // Next link is not in the same group, need to tranfer with
-                // messages
-                send_messages.push_back(
-                    TroonMessage(*transit_troon, link_id, dst_link_id));
-
-                // Remove the troon since it was sent out of our group.
-                // Since we do not want to invalidate any references we only
-                // remove the troon if it's the last one, otherwise we just
-                // mark it as invalid
-                if (link_state->in_transit == link_group.troons.size()) {
-                    link_group.troons.pop_back();
-                } else {
-                    // Invalidate troon
-                    transit_troon->on_link = 0;
-                }
-            }
+    std::vector<std::atomic<uint64_t>> ranges;
+    uint32_t num_links;
 
-            has_sent[transit_troon->line] = dst_link_id;
-            link_state->in_transit = 0;
-        }
+    ChunkQueues(int num_threads, uint32_t num_links);
 
-        // We also need to notify the other connecting links that
-        // no new troons have arrived
-        Troon empty_troon;
-        for (uint32_t line = 0; line < num_lines; line++) {
-            uint32_t dst_link_id = link->next_link[line];
+    // Hands out all chunks again, not thread safe
+    void reset();
 
-            if (!dst_link_id) {
-                // No connecting link for this line
-                continue;
-            }
-            if (link_group.has_link(dst_link_id)) {
-                // No need to send message if it's the same link group
-                continue;
-            }
-            if (arr_contains(dst_link_id, has_sent, line + 1)) {
-                // We have already sent a message for this line
-                continue;
-            }
+    bool take(int thread, uint32_t &chunk);
+};
 
-            send_messages.push_back(
-                TroonMessage(empty_troon, link_id, dst_link_id));
+ChunkQueues::ChunkQueues(int num_threads, uint32_t num_links)
+    : ranges(num_threads), num_links(num_links) {
+    reset();
+}
 
-            has_sent[line] = dst_link_id;
-        }
+void ChunkQueues::reset() {
+    uint64_t num_chunks = (num_links + chunk_size - 1) / chunk_size;
+    uint64_t num_threads = ranges.size();
 
-        // We need to receive all incoming troons from other links
-        uint32_t has_received[num_lines] = {};
-        for (uint32_t line = 0; line < num_lines; line++) {
-            uint32_t src_link_id = link->prev_link[line];
-            if (!src_link_id) {
-                // No connecting link for this line
-                continue;
-            }
-            if (link_group.has_link(src_link_id)) {
-                // No need to receive message if it's the same link group
-                continue;
-            }
-            if (arr_contains(src_link_id, has_received, line + 1)) {
-                // We have already received a message for this line
-                continue;
-            }
+    for (uint64_t thread = 0; thread < num_threads; thread++) {
+        uint64_t begin = num_chunks * thread / num_threads;
+        uint64_t end = num_chunks * (thread + 1) / num_threads;
+        ranges[thread].store(begin << 32 | end, std::memory_order_relaxed);
+    }
+}
 
-            receive_messages.push_back(TroonMessage(src_link_id, link_id));
+bool ChunkQueues::take(int thread, uint32_t &chunk) {
+    int num_threads = ranges.size();
 
-            has_received[line] = src_link_id;
-        }
-    }
+    for (int i = 0; i < num_threads; i++) {
+        bool own = !i;
+        std::atomic<uint64_t> &range = ranges[(thread + i) % num_threads];
 
-    int send_count = send_messages.size();
-    int receive_count = receive_messages.size();
+        uint64_t packed = range.load(std::memory_order_relaxed);
+        while (true) {
+            uint32_t begin = packed >> 32;
+            uint32_t end = packed;
+            if (begin >= end) {
+                break;
+            }
 
-    // Send all messages
-    send_requests.resize(send_count);
-    for (int i = 0; i < send_count; i++) {
-        send_troon_message(i, network, num_proc, send_messages,
-                           send_requests);
+            uint64_t taken = own ? uint64_t(begin + 1) << 32 | end
+                                 : uint64_t(begin) << 32 | (end - 1);
+            if (range.compare_exchange_weak(packed, taken,
+                                            std::memory_order_relaxed)) {
+                chunk = own ? begin : end - 1;
+                return true;
+            }
+        }
     }
 
-    // Receive all messages
-    receive_requests.resize(receive_count);
-    for (int i = 0; i < receive_count; i++) {
-        receive_troon_message(i, network, num_proc, receive_messages,
-                              receive_requests);
-    }
+    return false;
+}
 
-    // Wait for all receive requests to complete
-    MPI_Waitall(receive_count, receive_requests.data(),
-                MPI_STATUSES_IGNORE);
+// Barrier for the threads of a tick, the last thread to arrive runs the
+// completion before the others are released
+struct TickBarrier {
+    std::mutex mutex;
+    std::condition_variable released;
+    int num_threads;
+    int waiting;
+    uint64_t generation;
 
-    // Handle the received messages
-    for (auto &rec_msg : receive_messages) {
-        Troon &arriving_troon = rec_msg.troon;
+    TickBarrier(int num_threads);
 
-        // Ignore empty troon
-        if (!arriving_troon.on_link) {
-            continue;
-        }
+    void wait(const std::function<void()> &completion);
+};
 
-        // Add arriving troon to waiting platform
-        link_group.troons.push_back(arriving_troon);
+TickBarrier::TickBarrier(int num_threads)
+    : num_threads(num_threads), waiting(0), generation(0) {}
 
-        LinkState *link_state =
-            link_group.get_link_state(arriving_troon.on_link);
+void TickBarrier::wait(const std::function<void()> &completion) {
+    std::unique_lock<std::mutex> lock(mutex);
 
-        assert(link_state);
+    if (++waiting == num_threads) {
+        completion();
 
-        link_state->waiting_platform.push(link_group.troons.size());
+        waiting = 0;
+        generation++;
+        released.notify_all();
+        return;
     }
 
-    for (uint32_t link_id = link_group.start; link_id < link_group.end;
-         link_id++) {
-        LinkState *link_state = link_group.get_link_state(link_id);
-
-        // Move from platform to link
-        if (link_state->on_platform) {
-            Troon *platform_troon =
-                link_group.get_troon(link_state->on_platform);
-            if (platform_troon->state == Troon::State::waiting_transit) {
-                platform_troon->state = Troon::State::in_transit;
-                platform_troon->state_timestamp = tick;
-
-                link_state->in_transit = link_state->on_platform;
-                link_state->on_platform = 0;
-            } else {
-                if (!link_state->in_transit) {
-                    // Check if troon is finished with opening
-                    // and closing doors and letting passengers on
-                    const Station *station = network.src(link_id);
-                    if (tick - platform_troon->state_timestamp >
-                        station->popularity) {
-                        platform_troon->state = Troon::State::waiting_transit;
-                        platform_troon->state_timestamp = tick;
-                    }
-                }
-            }
-        }
+    uint64_t my_generation = generation;
+    released.wait(lock, [&] { return generation != my_generation; });
+}
 
-        // Move from waiting area to platform
-        if (!link_state->on_platform && !link_state->waiting_platform.empty()) {
-            // Get the next troon on the waiting platform,
-            // skip if the troon is invalidated
-            uint32_t troon_index;
-            Troon *troon;
+// Shared memory engine for a single process: the threads share one link
+// group and take chunks of links with work stealing. A troon moving to
+// another link is pushed onto the lock-free inbound stack of that link,
+// which the link moves into its waiting area in the next phase
+struct SharedEngine {
+    Network &network;
+    Partition partition;
+    LinkGroup link_group;
 
-            do {
-                troon_index = link_state->waiting_platform.top();
-                troon = link_group.get_troon(troon_index);
-                link_state->waiting_platform.pop();
-            } while (!link_state->waiting_platform.empty() && !troon->on_link);
+    // Top troon index of the inbound stack of every link, and the troon
+    // below every troon index
+    std::vector<std::atomic<uint32_t>> inbound;
+    std::vector<uint32_t> inbound_next;
 
-            if (troon->on_link) {
-                link_state->on_platform = troon_index;
+    ChunkQueues chunks;
+    TickBarrier barrier;
+    uint32_t tick;
 
-                troon->state = Troon::State::on_platform;
-                troon->state_timestamp = tick;
-            }
-        }
+    SharedEngine(Network &network, int num_threads);
+
+    void run();
+
+   private:
+    void work(int thread);
+    void complete_transits(uint32_t link_id);
+    void update_link(uint32_t link_id);
+    void start_tick();
+    void finish_tick();
+};
+
+SharedEngine::SharedEngine(Network &network, int num_threads)
+    : network(network), partition(network, 1),
+      link_group(network, partition, 0), inbound(network.links.size()),
+      chunks(num_threads, network.links.size()), barrier(num_threads),
+      tick(0) {}
+
+void SharedEngine::run() {
+    if (!network.ticks) {
+        return;
     }
 
-    // Wait for all send requests to complete
-    MPI_Waitall(send_count, send_requests.data(),
-                MPI_STATUSES_IGNORE);
-}
+    start_tick();
 
-std::string troon_name(const Troon &troon) {
-    char prefix[3] = {'g', 'y', 'b'};
-    return std::string(1, prefix[troon.line]) + std::to_string(troon.id);
+    int num_threads = chunks.ranges.size();
+    std::vector<std::thread> threads;
+    for (int thread = 1; thread < num_threads; thread++) {
+        threads.emplace_back(&SharedEngine::work, this, thread);
+    }
+
+    work(0);
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
 }
 
-void print_troons(std::vector<Troon> &troons, const Network &network,
-                  uint32_t tick) {
-    std::sort(troons.begin(), troons.end(),
-              [](const Troon &a, const Troon &b) {
-                  return troon_name(a) < troon_name(b);
-              });
+void SharedEngine::work(int thread) {
+    uint32_t num_links = network.links.size();
 
-    std::cout << tick << ": ";
-    for (const auto &troon : troons) {
-        if (!troon.on_link) {
-            // Skip invalid troon
-            continue;
+    auto for_chunks = [&](auto update) {
+        uint32_t chunk;
+        while (chunks.take(thread, chunk)) {
+            uint32_t begin = chunk * ChunkQueues::chunk_size;
+            uint32_t end = std::min(begin + ChunkQueues::chunk_size, num_links);
+            for (uint32_t link_id = begin + 1; link_id <= end; link_id++) {
+                update(link_id);
+            }
         }
+    };
 
-        std::cout << troon_name(troon);
+    while (true) {
+        for_chunks([this](uint32_t link_id) { complete_transits(link_id); });
+        barrier.wait([this] { chunks.reset(); });
 
-        uint32_t src = network.links[troon.on_link - 1].src;
-        std::cout << "-" << network.station_names[src];
+        for_chunks([this](uint32_t link_id) { update_link(link_id); });
+        barrier.wait([this] { finish_tick(); });
 
-        if (troon.state == Troon::State::in_transit) {
-            uint32_t dst = network.links[troon.on_link - 1].dst;
-            std::cout << "->" << network.station_names[dst];
-        } else if (troon.state == Troon::State::waiting_platform) {
-            std::cout << "#";
-        } else {
-            std::cout << "%";
+        // Every thread sees the tick of the completion after the barrier
+        if (tick == network.ticks) {
+            break;
         }
+    }
+}
 
-        std::cout << " ";
+void SharedEngine::complete_transits(uint32_t link_id) {
+    if (!link_group.transit_done(link_id, tick)) {
+        return;
     }
 
-    std::cout << '\n'
-              << std::flush;
+    const Troon *transit_troon = link_group.get_troon(
+        link_group.link_states.in_transit[link_group.link_index(link_id)]);
+    uint32_t dst_link_id =
+        network.links[link_id - 1].next_link[transit_troon->line];
+    uint32_t troon_index =
+        link_group.finish_transit(link_id, dst_link_id, tick);
+
+    std::atomic<uint32_t> &head = inbound[dst_link_id - 1];
+    uint32_t top = head.load(std::memory_order_relaxed);
+    do {
+        inbound_next[troon_index] = top;
+    } while (!head.compare_exchange_weak(top, troon_index,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
 }
 
-void main_proc_exec(int argc, char *argv[], int num_proc) {
-    std::vector<std::string> station_names;
-    uint32_t num_stations;
-    uint32_t ticks;
-    uint32_t num_green;
-    uint32_t num_yellow;
-    uint32_t num_blue;
-    uint32_t num_print_lines;
-
-    if (argc < 2) {
-        std::cerr << argv[0] << " <input_file>\n";
-        std::exit(1);
+void SharedEngine::update_link(uint32_t link_id) {
+    // Most links get nothing, skip the exchange for them
+    std::atomic<uint32_t> &head = inbound[link_id - 1];
+    uint32_t troon_index = 0;
+    if (head.load(std::memory_order_relaxed)) {
+        troon_index = head.exchange(0, std::memory_order_acquire);
     }
-
-    std::ifstream ifs(argv[1], std::ios_base::in);
-    if (!ifs.is_open()) {
-        std::cerr << "Failed to open " << argv[1] << '\n';
-        std::exit(2);
+    while (troon_index) {
+        link_group.enqueue(troon_index);
+        troon_index = inbound_next[troon_index];
     }
 
-    ifs >> num_stations;
-    std::string station_name;
-    station_names.reserve(num_stations);
-    for (size_t i = 0; i < num_stations; i++) {
-        ifs >> station_name;
-        station_names.emplace_back(station_name);
-    }
+    link_group.update_platform(link_id, tick);
+}
 
-    uint32_t popularity;
-    std::vector<uint32_t> popularities;
-    popularities.reserve(num_stations);
-    for (size_t i = 0; i < num_stations; i++) {
-        ifs >> popularity;
-        popularities.emplace_back(popularity);
+// Runs on one thread between the phases
+void SharedEngine::start_tick() {
+    spawn_troons(network, link_group, tick);
+    inbound_next.resize(link_group.troons.size() + 1);
+    chunks.reset();
+}
+
+void SharedEngine::finish_tick() {
+    if (network.ticks - network.num_print_lines <= tick) {
+        std::vector<Troon> all_troons = link_group.troons;
+        print_troons(all_troons, network, tick);
     }
 
-    adjacency_matrix mat(num_stations, std::vector<uint32_t>(num_stations));
-    for (size_t src = 0; src < num_stations; src++) {
-        for (size_t dst = 0; dst < num_stations; dst++) {
-            ifs >> mat[src][dst];
-        }
+    tick++;
+    if (tick < network.ticks) {
+        start_tick();
     }
+}
 
-    ifs.ignore();
+void shared_exec(const Options &options) {
+    Network network = read_network(options.input_path, 0, 1);
+    SharedEngine engine(network, options.num_threads);
+    engine.run();
+}
 
-    std::string stations_buffer;
+// Partitions the links on the root and distributes the partition,
+// renumbering the links if the partition needs it
+Partition partition_network(Network &network, const Options &options,
+                            int rank, int num_proc) {
+    Partition partition(num_proc);
+    if (!rank) {
+        if (options.graph_partition) {
+            partition = Partition::minimize_cut(network, num_proc);
+        } else {
+            partition = Partition(network, num_proc);
+        }
+    }
 
-    std::getline(ifs, stations_buffer);
-    std::vector<std::string> green_station_names =
-        extract_station_names(stations_buffer);
+    partition.broadcast(options.graph_partition, network.links.size());
 
-    std::getline(ifs, stations_buffer);
-    std::vector<std::string> yellow_station_names =
-        extract_station_names(stations_buffer);
+    if (options.graph_partition) {
+        size_t contiguous_cut = 0;
+        if (!rank) {
+            contiguous_cut = Partition(network, num_proc).cut_size(network);
+        }
 
-    std::getline(ifs, stations_buffer);
-    std::vector<std::string> blue_station_names =
-        extract_station_names(stations_buffer);
+        network.renumber(partition.order);
 
-    ifs >> ticks;
+        if (!rank) {
+            std::cerr << "Graph partition cut: " << partition.cut_size(network)
+                      << " link connections between ranks (contiguous: "
+                      << contiguous_cut << ")\n";
+        }
+    }
 
-    ifs >> num_green;
-    ifs >> num_yellow;
-    ifs >> num_blue;
+    return partition;
+}
 
-    ifs >> num_print_lines;
+void main_proc_exec(const Options &options, int num_proc) {
+    Network network = read_network(options.input_path, 0, num_proc);
+    Partition partition = partition_network(network, options, 0, num_proc);
 
-    Network network(num_stations, popularities, mat, station_names,
-                    green_station_names, yellow_station_names, blue_station_names,
-                    ticks, num_green, num_yellow, num_blue, num_print_lines);
+    LinkGroup link_group(network, partition, 0);
 
-    network.broadcast();
+    if (options.lookahead) {
+        simulate_lookahead(network, link_group, partition, 0, num_proc);
+        return;
+    }
 
-    LinkGroup link_group(0, num_proc, network.links.size());
+    TickExchange exchange(network, partition, link_group, 0,
+                          options.exchange);
+    CycleDetector cycles;
 
     std::vector<Troon> all_troons;
-    for (uint32_t tick = 0; tick < network.ticks; tick++) {
-        simulate_tick(network, link_group, tick, num_proc);
+    uint32_t steps = 0;
+    for (uint32_t tick = 0; tick < network.ticks;
+         tick = next_tick(network, link_group, options, tick)) {
+        simulate_tick(network, link_group, partition, exchange, tick,
+                      options.num_threads);
 
         if (network.ticks - network.num_print_lines <= tick) {
-            gather_all_troons(link_group, num_proc, all_troons);
+            gather_all_troons(link_group.live_troons(), num_proc,
+                              all_troons);
             print_troons(all_troons, network, tick);
         }
+
+        if (options.rebalance_interval &&
+            ++steps % options.rebalance_interval == 0 &&
+            rebalance(network, link_group, partition, 0, num_proc)) {
+            exchange = TickExchange(network, partition, link_group, 0,
+                                    options.exchange);
+        }
+
+        if (options.fast_forward) {
+            tick = cycles.fast_forward(network, link_group, tick,
+                                       network.ticks - network.num_print_lines);
+        }
     }
 }
 
-void sub_proc_exec(int rank, int num_proc) {
-    Network network;
-    network.receive();
+void sub_proc_exec(const Options &options, int rank, int num_proc) {
+    Network network = read_network(options.input_path, rank, num_proc);
+    Partition partition = partition_network(network, options, rank, num_proc);
+
+    LinkGroup link_group(network, partition, rank);
+
+    if (options.lookahead) {
+        simulate_lookahead(network, link_group, partition, rank, num_proc);
+        return;
+    }
 
-    LinkGroup link_group(rank, num_proc, network.links.size());
+    TickExchange exchange(network, partition, link_group, rank,
+                          options.exchange);
+    CycleDetector cycles;
 
-    for (uint32_t tick = 0; tick < network.ticks; tick++) {
-        simulate_tick(network, link_group, tick, num_proc);
+    uint32_t steps = 0;
+    for (uint32_t tick = 0; tick < network.ticks;
+         tick = next_tick(network, link_group, options, tick)) {
+        simulate_tick(network, link_group, partition, exchange, tick,
+                      options.num_threads);
 
         if (network.ticks - network.num_print_lines <= tick) {
-            send_all_troons(link_group);
+            send_all_troons(link_group.live_troons());
+        }
+
+        if (options.rebalance_interval &&
+            ++steps % options.rebalance_interval == 0 &&
+            rebalance(network, link_group, partition, rank, num_proc)) {
+            exchange = TickExchange(network, partition, link_group, rank,
+                                    options.exchange);
+        }
+
+        if (options.fast_forward) {
+            tick = cycles.fast_forward(network, link_group, tick,
+                                       network.ticks - network.num_print_lines);
         }
     }
 }
@@ -1057,7 +4423,9 @@ int main(int argc, char *argv[]) {
     int num_proc;
     int rank;
 
-    MPI_Init(&argc, &argv);
+    // Only the main thread makes MPI calls
+    int thread_support;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &thread_support);
     MPI_Comm_size(MPI_COMM_WORLD, &num_proc);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
 
@@ -1065,10 +4433,72 @@ int main(int argc, char *argv[]) {
     Link::register_type();
     Troon::register_type();
 
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
+        // Compiling is done by the root alone
+        if (!rank) {
+            compile_exec(argc, argv);
+        }
+
+        MPI_Finalize();
+        return 0;
+    }
+
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        if (!rank) {
+            std::cerr << argv[0]
+                      << " [--partition=load|graph] [--rebalance=<steps>]"
+                         " [--lookahead] [--exchange=p2p|neighbor|rma]"
+                         " [--threads=<n>] [--engine=mpi|threads]"
+                         " [--event-driven] [--fast-forward]"
+                         " <input_file>\n";
+        }
+
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (const char *option = unsupported_option(options)) {
+        if (!rank) {
+            std::cerr << option << " does not work with "
+                      << (options.shared_engine ? "--engine=threads"
+                                                : "--lookahead")
+                      << '\n';
+        }
+
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (options.shared_engine) {
+        if (num_proc > 1) {
+            if (!rank) {
+                std::cerr << "The threads engine runs a single process\n";
+            }
+
+            MPI_Finalize();
+            return 1;
+        }
+
+        shared_exec(options);
+
+        MPI_Finalize();
+        return 0;
+    }
+
+    if (options.num_threads > 1 && thread_support < MPI_THREAD_FUNNELED) {
+        if (!rank) {
+            std::cerr << "MPI library does not support threads\n";
+        }
+
+        MPI_Finalize();
+        return 1;
+    }
+
     if (!rank) {
-        main_proc_exec(argc, argv, num_proc);
+        main_proc_exec(options, num_proc);
     } else {
-        sub_proc_exec(rank, num_proc);
+        sub_proc_exec(options, rank, num_proc);
     }
 
     MPI_Finalize();